@@ -55,7 +55,7 @@ void Cbundle::prep(const std::string prefix, const int imageThreshold, const int
 
     m_dlevel   = 7;
     m_maxLevel = 12;
-    m_pss.init(images, prefix, m_maxLevel + 1, 5, 0);
+    m_pss.init(images, prefix, m_maxLevel + 1, 5, 0, 0, m_CPU);
   
     std::cerr << "Set widths/heights..." << std::flush;
     setWidthsHeightsLevels();
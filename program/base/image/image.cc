@@ -1,6 +1,18 @@
 #include <algorithm>
 #include <list>
 #include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && 2 <= _M_IX86_FP)
+#define PMVS_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "../numeric/mat4.h"
 #include "image.h"
 #include <setjmp.h>
@@ -55,8 +67,11 @@ void Cimage::completeName(const std::string& lhs, std::string& rhs,
 }
 
 void Cimage::init(const std::string name, const std::string mname,
-		  const int maxLevel) {
+		  const int maxLevel, const int minLevel, const int cache,
+                  const int layout) {
   m_alloc = 0;
+  m_cache = cache;
+  m_layout = layout;
 
   if (!name.empty())
     completeName(name, m_name, 1);
@@ -69,20 +84,26 @@ void Cimage::init(const std::string name, const std::string mname,
     cerr << "Number of level 0, set it to 1." << endl;
     m_maxLevel = 1;
   }
+  m_minLevel = max(0, min(m_maxLevel - 1, minLevel));
 }
 
 void Cimage::init(const std::string name, const std::string mname,
-		  const std::string ename, const int maxLevel) {
-  init(name, mname, maxLevel);
+		  const std::string ename, const int maxLevel, const int minLevel,
+                  const int cache, const int layout) {
+  init(name, mname, maxLevel, minLevel, cache, layout);
   if (!ename.empty())
     completeName(ename, m_ename, 0);
 }
 
 void Cimage::alloc(const int fast, const int filter) {
-  if (m_alloc == 1 && fast == 1)
+  if (m_alloc != 0 && fast == 1)
     return;
   if (m_alloc == 2)
     return;
+  if (m_alloc == 3) {
+    allocImage(filter);
+    return;
+  }
 
   if (m_name.length() < 3) {
     cerr << "Image file name has less than 3 characters." << endl
@@ -94,13 +115,15 @@ void Cimage::alloc(const int fast, const int filter) {
   m_edges.resize(m_maxLevel);   m_widths.resize(m_maxLevel);
   m_heights.resize(m_maxLevel);
 
-  if (readJpegImage(m_name, m_images[0], m_widths[0], m_heights[0], fast) == 0 &&
-      readPPMImage(m_name, m_images[0], m_widths[0], m_heights[0], fast) == 0) {
-    cerr << "Only jpeg and ppm formats are allowed. Stop allocation: "
-	 << m_name << endl;
+  if (!fast && m_cache && readCache(filter)) {
+    buildTiles();
+    m_alloc = 2;
     return;
   }
 
+  if (readImage(fast) == 0)
+    return;
+
   // set widths, heights
   for (int level = 1; level < m_maxLevel; ++level) {
     m_widths[level] = m_widths[level - 1] / 2;
@@ -150,10 +173,159 @@ void Cimage::alloc(const int fast, const int filter) {
   //----------------------------------------------------------------------
   // build image/mask/edge pyramids
   buildImageMaskEdge(filter);
+  if (0 < m_minLevel)
+    free(m_minLevel);
+
+  if (m_cache)
+    writeCache(filter);
+  buildTiles();
 
   m_alloc = 2;
 }
 
+namespace {
+const char cacheMagic[8] = {'P', 'M', 'V', 'S', 'P', 'Y', 'R', '1'};
+
+// Header entries: stamps of the image, mask and edge files, whether the
+// mask and edge were read, maxLevel, minLevel, filter, width and height.
+enum { cacheStamps = 6, cacheHasMask = 6, cacheHasEdge = 7,
+       cacheMaxLevel = 8, cacheMinLevel = 9, cacheFilter = 10,
+       cacheWidth = 11, cacheHeight = 12, cacheHeaderSize = 13 };
+
+void fileStamp(const std::string& name, long long& time, long long& size) {
+  struct stat st;
+  if (name.empty() || stat(name.c_str(), &st) != 0) {
+    time = -1;    size = -1;
+  }
+  else {
+    time = (long long)st.st_mtime;    size = (long long)st.st_size;
+  }
+}
+}
+
+std::string Cimage::cacheName(void) const {
+  const size_t slash = m_name.find_last_of("/\\");
+  const size_t dot = m_name.rfind('.');
+  if (dot == string::npos || (slash != string::npos && dot < slash))
+    return m_name + ".pyr";
+  else
+    return m_name.substr(0, dot) + ".pyr";
+}
+
+void Cimage::cacheHeader(const int filter, long long header[]) const {
+  fileStamp(m_name, header[0], header[1]);
+  fileStamp(m_mname, header[2], header[3]);
+  fileStamp(m_ename, header[4], header[5]);
+  header[cacheHasMask] = !m_masks.empty() && !m_masks[m_minLevel].empty();
+  header[cacheHasEdge] = !m_edges.empty() && !m_edges[m_minLevel].empty();
+  header[cacheMaxLevel] = m_maxLevel;
+  header[cacheMinLevel] = m_minLevel;
+  header[cacheFilter] = filter;
+  header[cacheWidth] = m_widths.empty() ? 0 : m_widths[0];
+  header[cacheHeight] = m_heights.empty() ? 0 : m_heights[0];
+}
+
+int Cimage::readCache(const int filter, const int imageOnly) {
+  ifstream ifstr(cacheName().c_str(), ios::binary);
+  if (!ifstr)
+    return 0;
+
+  char magic[8];
+  long long header[cacheHeaderSize], expected[cacheHeaderSize];
+  ifstr.read(magic, sizeof(magic));
+  ifstr.read((char*)header, sizeof(header));
+  if (!ifstr || memcmp(magic, cacheMagic, sizeof(magic)) != 0)
+    return 0;
+
+  // Stale if any source file or the pyramid parameters changed
+  cacheHeader(filter, expected);
+  for (int i = 0; i < cacheStamps; ++i)
+    if (header[i] != expected[i])
+      return 0;
+  for (int i = cacheMaxLevel; i <= cacheFilter; ++i)
+    if (header[i] != expected[i])
+      return 0;
+
+  m_widths[0] = (int)header[cacheWidth];
+  m_heights[0] = (int)header[cacheHeight];
+  for (int level = 1; level < m_maxLevel; ++level) {
+    m_widths[level] = m_widths[level - 1] / 2;
+    m_heights[level] = m_heights[level - 1] / 2;
+  }
+
+  for (int level = m_minLevel; level < m_maxLevel; ++level) {
+    const int size = m_widths[level] * m_heights[level];
+    m_images[level].resize(3 * size);
+    ifstr.read((char*)m_images[level].data(), 3 * size);
+    if (header[cacheHasMask] && imageOnly)
+      ifstr.seekg(size, ios::cur);
+    else if (header[cacheHasMask]) {
+      m_masks[level].resize(size);
+      ifstr.read((char*)m_masks[level].data(), size);
+    }
+    if (header[cacheHasEdge] && imageOnly)
+      ifstr.seekg(size, ios::cur);
+    else if (header[cacheHasEdge]) {
+      m_edges[level].resize(size);
+      ifstr.read((char*)m_edges[level].data(), size);
+    }
+  }
+
+  // Truncated file, decode from scratch
+  if (!ifstr) {
+    for (int level = 0; level < m_maxLevel; ++level)
+      vector<unsigned char>().swap(m_images[level]);
+    if (!imageOnly)
+      free(m_maxLevel);
+    return 0;
+  }
+  if (imageOnly)
+    return 1;
+
+  if (!header[cacheHasMask])
+    m_mname = "";
+  if (!header[cacheHasEdge])
+    m_ename = "";
+  return 1;
+}
+
+void Cimage::writeCache(const int filter) const {
+  const string cname = cacheName();
+  // Written aside and renamed, so that concurrent runs never read a
+  // partially written file
+  char suffix[32];
+  sprintf(suffix, ".%08x", (unsigned int)random_device()());
+  const string tmp = cname + suffix;
+
+  ofstream ofstr(tmp.c_str(), ios::binary);
+  if (!ofstr)
+    return;
+
+  long long header[cacheHeaderSize];
+  cacheHeader(filter, header);
+  ofstr.write(cacheMagic, sizeof(cacheMagic));
+  ofstr.write((const char*)header, sizeof(header));
+  for (int level = m_minLevel; level < m_maxLevel; ++level) {
+    ofstr.write((const char*)m_images[level].data(), m_images[level].size());
+    if (header[cacheHasMask])
+      ofstr.write((const char*)m_masks[level].data(), m_masks[level].size());
+    if (header[cacheHasEdge])
+      ofstr.write((const char*)m_edges[level].data(), m_edges[level].size());
+  }
+  ofstr.close();
+
+  if (!ofstr) {
+    remove(tmp.c_str());
+    return;
+  }
+  // rename does not replace an existing file on every platform
+  if (rename(tmp.c_str(), cname.c_str()) != 0) {
+    remove(cname.c_str());
+    if (rename(tmp.c_str(), cname.c_str()) != 0)
+      remove(tmp.c_str());
+  }
+}
+
 void Cimage::free(const int freeLevel) {
   for (int l = 0; l < freeLevel; ++l) {
 #ifdef FURUKAWA_IMAGE_GAMMA
@@ -165,9 +337,55 @@ void Cimage::free(const int freeLevel) {
       vector<unsigned char>().swap(m_masks[l]);
     if (!m_edges.empty())
       vector<unsigned char>().swap(m_edges[l]);
+    if (!m_tiles.empty())
+      vector<unsigned char>().swap(m_tiles[l]);
   }
 }
 
+void Cimage::freeImage(void) {
+  if (m_alloc != 2)
+    return;
+  for (int level = 0; level < (int)m_images.size(); ++level)
+    vector<unsigned char>().swap(m_images[level]);
+  vector<vector<unsigned char>>().swap(m_tiles);
+  m_alloc = 3;
+}
+
+long long Cimage::getImageBytes(void) const {
+  long long bytes = 0;
+  for (int level = 0; level < (int)m_images.size(); ++level)
+    bytes += m_images[level].size();
+  for (int level = 0; level < (int)m_tiles.size(); ++level)
+    bytes += m_tiles[level].size();
+  return bytes;
+}
+
+int Cimage::readImage(const int fast) {
+  // Jpeg images are decoded straight at the finest level kept, as far as
+  // libjpeg can scale. buildImage fills the levels above the decoded one.
+  const int decodeLevel = min(3, m_minLevel);
+  if (readJpegImage(m_name, m_images[decodeLevel], m_widths[0], m_heights[0], fast, decodeLevel) == 0 &&
+      readPPMImage(m_name, m_images[0], m_widths[0], m_heights[0], fast) == 0) {
+    cerr << "Only jpeg and ppm formats are allowed. Stop allocation: "
+	 << m_name << endl;
+    return 0;
+  }
+  return 1;
+}
+
+void Cimage::allocImage(const int filter) {
+  // Masks and edges were kept by freeImage
+  if (!m_cache || !readCache(filter, 1)) {
+    if (readImage(0) == 0)
+      exit (1);
+    buildImage(filter);
+    if (0 < m_minLevel)
+      free(m_minLevel);
+  }
+  buildTiles();
+  m_alloc = 2;
+}
+
 void Cimage::free(void) {
   if (m_alloc != 0)
     m_alloc = 1;
@@ -177,6 +395,42 @@ void Cimage::free(void) {
   vector<vector<unsigned char>>().swap(m_images);
   vector<vector<unsigned char>>().swap(m_masks);
   vector<vector<unsigned char>>().swap(m_edges);
+  vector<vector<unsigned char>>().swap(m_tiles);
+}
+
+void Cimage::buildTiles(void) {
+  if (m_layout != 1)
+    return;
+
+  m_tiles.resize(m_maxLevel);
+  for (int level = 0; level < m_maxLevel; ++level) {
+    if (m_images[level].empty()) {
+      vector<unsigned char>().swap(m_tiles[level]);
+      continue;
+    }
+
+    // A border tile on each side repeats the pixels at the edge. The extra
+    // bytes let getView start the tiles on a cache line.
+    const int width = m_widths[level];
+    const int height = m_heights[level];
+    const int tiles = (width + 3) / 4 + 2;
+    const int rows = (height + 3) / 4 + 2;
+    m_tiles[level].assign(64 * tiles * rows + 63, (unsigned char)0);
+
+    const SimageView view = getView(level);
+    unsigned char* pixels = const_cast<unsigned char*>(view.m_pixels);
+    for (int y = -4; y < 4 * rows - 4; ++y) {
+      const int iy = max(0, min(height - 1, y));
+      for (int x = -4; x < 4 * tiles - 4; ++x) {
+        const int ix = max(0, min(width - 1, x));
+        const unsigned char* src = &m_images[level][3 * (iy * width + ix)];
+        unsigned char* dst = pixels + view.offset(x, y);
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+      }
+    }
+  }
 }
 
 void Cimage::buildImageMaskEdge(const int filter) {
@@ -189,171 +443,223 @@ void Cimage::buildImageMaskEdge(const int filter) {
     buildEdge();
 }
 
-void Cimage::buildImage(const int filter) {
-  Mat4 mask;
-  mask[0] = Vec4(1.0, 3.0, 3.0, 1.0);  mask[1] = Vec4(3.0, 9.0, 9.0, 3.0);
-  mask[2] = Vec4(3.0, 9.0, 9.0, 3.0);  mask[3] = Vec4(1.0, 3.0, 3.0, 1.0);
-
-  float total = 64.0f;
-  for (int y = 0; y < 4; ++y)
-    for (int x = 0; x < 4; ++x)
-      mask[y][x] /= total;
+namespace {
+// Pixel (x, y) of the next level of an rgb image of width x height
+// pixels, with the 4x4 mask of buildImage. Pixels outside the image are
+// skipped and the weights of the others renormalized.
+void downsamplePixel(const unsigned char* src, const int width,
+                     const int height, const int x, const int y,
+                     const int filter, unsigned char* dst) {
+  static const int weights[4] = {1, 3, 3, 1};
+  int color[3];
+  for (int c = 0; c < 3; ++c)
+    color[c] = filter == 2 ? 255 : 0;
+  int denom = 0;
+
+  for (int j = -1; j < 3; ++j) {
+    const int ytmp = 2 * y + j;
+    if (ytmp < 0 || height - 1 < ytmp)
+      continue;
+
+    for (int i = -1; i < 3; ++i) {
+      const int xtmp = 2 * x + i;
+      if (xtmp < 0 || width - 1 < xtmp)
+        continue;
 
-  //----------------------------------------------------------------------
-  // image
-  for (int level = 1; level < m_maxLevel; ++level) {
-    const int size = m_widths[level] * m_heights[level] * 3;
-    m_images[level].resize(size);
-
-    for (int y = 0; y < m_heights[level]; ++y) {
-      for (int x = 0; x < m_widths[level]; ++x) {
-
-	Vec3 color;
-        if (filter == 2)
-          color[0] = color[1] = color[2] = 255.0;
-
-	float denom = 0.0;
-
-	for (int j = -1; j < 3; ++j) {
-	  const int ytmp = 2 * y + j;
-	  if (ytmp < 0 || m_heights[level - 1] - 1 < ytmp)
-	    continue;
-
-	  for (int i = -1; i < 3; ++i) {
-	    const int xtmp = 2 * x + i;
-	    if (xtmp < 0 || m_widths[level - 1] - 1 < xtmp)
-	      continue;
-
-	    const int index = (ytmp * m_widths[level - 1] + xtmp) * 3;
-            if (filter == 0) {
-              color[0] += mask[j+1][i+1] * (double)m_images[level - 1][index];
-              color[1] += mask[j+1][i+1] * (double)m_images[level - 1][index+1];
-              color[2] += mask[j+1][i+1] * (double)m_images[level - 1][index+2];
-              denom += mask[j+1][i+1];
-            }
-            else if (filter == 1) {
-              color[0] = max(color[0], (double)m_images[level - 1][index]);
-              color[1] = max(color[1], (double)m_images[level - 1][index+1]);
-              color[2] = max(color[2], (double)m_images[level - 1][index+2]);
-            }
-            else {
-              color[0] = min(color[0], (double)m_images[level - 1][index]);
-              color[1] = min(color[1], (double)m_images[level - 1][index+1]);
-              color[2] = min(color[2], (double)m_images[level - 1][index+2]);
-            }
-          }
-	}
+      const unsigned char* pixel = src + (ytmp * width + xtmp) * 3;
+      const int weight = weights[j + 1] * weights[i + 1];
+      for (int c = 0; c < 3; ++c) {
         if (filter == 0)
-          color /= denom;
-	const int index = (y * m_widths[level] + x) * 3;
-	m_images[level][index] = (unsigned char)((int)floor(color[0] + 0.5f));
-	m_images[level][index + 1] = (unsigned char)((int)floor(color[1] + 0.5f));
-	m_images[level][index + 2] = (unsigned char)((int)floor(color[2] + 0.5f));
+          color[c] += weight * pixel[c];
+        else if (filter == 1)
+          color[c] = max(color[c], (int)pixel[c]);
+        else
+          color[c] = min(color[c], (int)pixel[c]);
       }
+      denom += weight;
     }
   }
-}
 
-void Cimage::buildMask(void) {
-  //----------------------------------------------------------------------
-  // mask
-  for (int level = 1; level < m_maxLevel; ++level) {
-    const int size = m_widths[level] * m_heights[level];
+  // Rounded to the nearest
+  for (int c = 0; c < 3; ++c)
+    dst[c] = (unsigned char)(filter == 0 ? (2 * color[c] + denom) / (2 * denom) : color[c]);
+}
 
-    m_masks[level].resize(size);
-    for (int y = 0; y < m_heights[level]; ++y) {
-      const int ys[2] = {2 * y, min(m_heights[level - 1] - 1, 2 * y + 1)};
-      for (int x = 0; x < m_widths[level]; ++x) {
-        const int xs[2] = {2 * x, min(m_widths[level - 1] - 1, 2 * x + 1)};
-        int in = 0;	int out = 0;
-
-        for (int j = 0; j < 2; ++j) {
-          for (int i = 0; i < 2; ++i) {
-            const int index = ys[j] * m_widths[level - 1] + xs[i];
-            if (m_masks[level - 1][index])
-              in++;
-            else
-              out++;
-          }
-        }
+// Vertical pass of the 4x4 mask over rows r0 to r3 of size bytes. With
+// filter 0, the rows are weighted 1 3 3 1, otherwise the max (filter 1)
+// or min (filter 2) is taken.
+void downsampleRows(const unsigned char* r0, const unsigned char* r1,
+                    const unsigned char* r2, const unsigned char* r3,
+                    const int size, const int filter, short* dst) {
+  int k = 0;
+#ifdef PMVS_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  for (; k + 16 <= size; k += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(r0 + k));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(r1 + k));
+    const __m128i c = _mm_loadu_si128((const __m128i*)(r2 + k));
+    const __m128i d = _mm_loadu_si128((const __m128i*)(r3 + k));
+    __m128i lo, hi;
+    if (filter == 0) {
+      const __m128i mid0 = _mm_add_epi16(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+      const __m128i mid1 = _mm_add_epi16(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+      lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(d, zero)),
+                         _mm_add_epi16(mid0, _mm_add_epi16(mid0, mid0)));
+      hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(d, zero)),
+                         _mm_add_epi16(mid1, _mm_add_epi16(mid1, mid1)));
+    }
+    else {
+      const __m128i e = filter == 1 ? _mm_max_epu8(_mm_max_epu8(a, b), _mm_max_epu8(c, d))
+                                    : _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d));
+      lo = _mm_unpacklo_epi8(e, zero);
+      hi = _mm_unpackhi_epi8(e, zero);
+    }
+    _mm_storeu_si128((__m128i*)(dst + k), lo);
+    _mm_storeu_si128((__m128i*)(dst + k + 8), hi);
+  }
+#endif
+  for (; k < size; ++k) {
+    if (filter == 0)
+      dst[k] = r0[k] + 3 * (r1[k] + r2[k]) + r3[k];
+    else if (filter == 1)
+      dst[k] = max(max(r0[k], r1[k]), max(r2[k], r3[k]));
+    else
+      dst[k] = min(min(r0[k], r1[k]), min(r2[k], r3[k]));
+  }
+}
 
-        const int index = y * m_widths[level] + x;
-        //if (out <= in)
-        if (0 < in)
-          m_masks[level][index] = (unsigned char)255;
-        else
-          m_masks[level][index] = (unsigned char)0;
-      }
+// Next level of a binary mask: a pixel is in if any of the 2x2 pixels
+// below is
+void downsampleBinary(const std::vector<unsigned char>& src, const int width,
+                      std::vector<unsigned char>& dst, const int dwidth,
+                      const int dheight) {
+  dst.resize(dwidth * dheight);
+  for (int y = 0; y < dheight; ++y) {
+    const unsigned char* r0 = &src[2 * y * width];
+    const unsigned char* r1 = r0 + width;
+    unsigned char* out = &dst[y * dwidth];
+
+    int x = 0;
+#ifdef PMVS_SSE2
+    // A pair of bytes is nonzero as a 16 bit lane
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i all  = _mm_set1_epi8((char)255);
+    for (; x + 16 <= dwidth; x += 16) {
+      const __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(r0 + 2 * x)),
+                                     _mm_loadu_si128((const __m128i*)(r1 + 2 * x)));
+      const __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(r0 + 2 * x + 16)),
+                                     _mm_loadu_si128((const __m128i*)(r1 + 2 * x + 16)));
+      const __m128i empty = _mm_packs_epi16(_mm_cmpeq_epi16(a, zero), _mm_cmpeq_epi16(b, zero));
+      _mm_storeu_si128((__m128i*)(out + x), _mm_andnot_si128(empty, all));
+    }
+#endif
+    for (; x < dwidth; ++x) {
+      if (r0[2 * x] || r0[2 * x + 1] || r1[2 * x] || r1[2 * x + 1])
+        out[x] = (unsigned char)255;
+      else
+        out[x] = (unsigned char)0;
     }
   }
 }
+}
 
-void Cimage::buildEdge(void) {
-  //----------------------------------------------------------------------
-  // edge
+void Cimage::buildImage(const int filter) {
+  // The 4x4 mask is 1 3 3 1 along both axes, applied as a vertical pass
+  // into rows and a horizontal one from them. Pixels whose mask sticks
+  // out of the image are left to downsamplePixel.
+  vector<short> rows;
   for (int level = 1; level < m_maxLevel; ++level) {
-    const int size = m_widths[level] * m_heights[level];
+    // Nothing to build from below the decoded level
+    if (m_images[level - 1].empty())
+      continue;
+    const int width = m_widths[level];
+    const int height = m_heights[level];
+    const int pwidth = m_widths[level - 1];
+    const int pheight = m_heights[level - 1];
+    const unsigned char* src = &m_images[level - 1][0];
+    m_images[level].resize(width * height * 3);
+    unsigned char* dst = &m_images[level][0];
+
+    // Interior pixels use source pixels 2x - 1 to 2x + 2
+    const int xend = max(1, min(width, (pwidth - 1) / 2));
+    const int yend = max(1, min(height, (pheight - 1) / 2));
+    rows.resize(3 * pwidth);
+
+    for (int y = 0; y < height; ++y) {
+      unsigned char* out = dst + y * width * 3;
+      if (y == 0 || yend <= y) {
+        for (int x = 0; x < width; ++x)
+          downsamplePixel(src, pwidth, pheight, x, y, filter, out + 3 * x);
+        continue;
+      }
 
-    m_edges[level].resize(size);
-    for (int y = 0; y < m_heights[level]; ++y) {
-      const int ys[2] = {2 * y, min(m_heights[level - 1] - 1, 2 * y + 1)};
-      for (int x = 0; x < m_widths[level]; ++x) {
-        const int xs[2] = {2 * x, min(m_widths[level - 1] - 1, 2 * x + 1)};
-        int in = 0;	int out = 0;
-
-        for (int j = 0; j < 2; ++j) {
-          for (int i = 0; i < 2; ++i) {
-            const int index = ys[j] * m_widths[level - 1] + xs[i];
-            if (m_edges[level - 1][index])
-              in++;
-            else
-              out++;
-          }
+      const unsigned char* r0 = src + (2 * y - 1) * pwidth * 3;
+      downsampleRows(r0, r0 + 3 * pwidth, r0 + 6 * pwidth, r0 + 9 * pwidth,
+                     3 * pwidth, filter, &rows[0]);
+
+      downsamplePixel(src, pwidth, pheight, 0, y, filter, out);
+      for (int x = 1; x < xend; ++x) {
+        const short* h = &rows[3 * (2 * x - 1)];
+        for (int c = 0; c < 3; ++c) {
+          if (filter == 0)
+            out[3 * x + c] = (unsigned char)((h[c] + 3 * (h[c + 3] + h[c + 6]) + h[c + 9] + 32) >> 6);
+          else if (filter == 1)
+            out[3 * x + c] = (unsigned char)max(max(h[c], h[c + 3]), max(h[c + 6], h[c + 9]));
+          else
+            out[3 * x + c] = (unsigned char)min(min(h[c], h[c + 3]), min(h[c + 6], h[c + 9]));
         }
-
-        const int index = y * m_widths[level] + x;
-        //if (out <= in)
-        if (0 < in)
-          m_edges[level][index] = (unsigned char)255;
-        else
-          m_edges[level][index] = (unsigned char)0;
       }
+      for (int x = xend; x < width; ++x)
+        downsamplePixel(src, pwidth, pheight, x, y, filter, out + 3 * x);
     }
   }
 }
 
+void Cimage::buildMask(void) {
+  for (int level = 1; level < m_maxLevel; ++level) {
+    if (m_masks[level - 1].empty())
+      continue;
+    downsampleBinary(m_masks[level - 1], m_widths[level - 1], m_masks[level],
+                     m_widths[level], m_heights[level]);
+  }
+}
+
+void Cimage::buildEdge(void) {
+  for (int level = 1; level < m_maxLevel; ++level) {
+    if (m_edges[level - 1].empty())
+      continue;
+    downsampleBinary(m_edges[level - 1], m_widths[level - 1], m_edges[level],
+                     m_widths[level], m_heights[level]);
+  }
+}
+
 void Cimage::setEdge(const float threshold) {
-  const int size = m_widths[0] * m_heights[0];
-  m_edges[0].resize(size);
+  // At the finest level kept
+  const int level = m_minLevel;
+  const int size = m_widths[level] * m_heights[level];
+  m_edges[level].resize(size);
   for (int i = 0; i < size; ++i)
-    m_edges[0][i] = (unsigned char)0;
-
-  vector<vector<float> > vvitmp, vvitmp2;
-  vvitmp.resize(m_heights[0]);
-  vvitmp2.resize(m_heights[0]);
-  for (int y = 0; y < m_heights[0]; ++y) {
-    vvitmp[y].resize(m_widths[0]);
-    vvitmp2[y].resize(m_widths[0]);
-    for (int x = 0; x < m_widths[0]; ++x) {
-      vvitmp[y][x] = 0;
-      vvitmp2[y][x] = 0;
-    }
-  }
+    m_edges[level][i] = (unsigned char)0;
+
+  const int width = m_widths[level];
+  const int height = m_heights[level];
+  vector<float> vitmp(size, 0.0f), vitmp2(size);
 
-  for (int y = 1; y < m_heights[0] - 1; ++y)
-    for (int x = 1; x < m_widths[0] - 1; ++x) {
-      const int index = 3 * (y * m_widths[0] + x);
+  for (int y = 1; y < height - 1; ++y)
+    for (int x = 1; x < width - 1; ++x) {
+      const int index = 3 * (y * width + x);
       const int rindex = index + 3;
       const int lindex = index - 3;
-      const int tindex = index - 3 * m_widths[0];
-      const int bindex = index + 3 * m_widths[0];
+      const int tindex = index - 3 * width;
+      const int bindex = index + 3 * width;
+      float& value = vitmp[y * width + x];
       for (int i = 0; i < 3; ++i) {
-        const int itmp0 = abs(m_images[0][rindex + i] -
-                              m_images[0][lindex + i]);
-        vvitmp[y][x] += itmp0 * itmp0;
-        const int itmp1 = abs(m_images[0][bindex + i] -
-                              m_images[0][tindex + i]);
-        vvitmp[y][x] += itmp1 * itmp1;
+        const int itmp0 = abs(m_images[level][rindex + i] -
+                              m_images[level][lindex + i]);
+        value += itmp0 * itmp0;
+        const int itmp1 = abs(m_images[level][bindex + i] -
+                              m_images[level][tindex + i]);
+        value += itmp1 * itmp1;
       }
     }
 
@@ -365,20 +671,14 @@ void Cimage::setEdge(const float threshold) {
   for (int i = -margin; i <= margin; ++i)
     filter[i + margin] = exp(- i * i / sigma2);
 
-  filterG(filter, vvitmp, vvitmp2);
+  filterG(filter, width, height, vitmp, vitmp2);
 
   const float newThreshold = threshold * threshold * (2 * margin + 1) * (2 * margin + 1) / 3.0f;
-  int count = -1;
-
-  for (int y = 0; y < m_heights[0]; ++y) {
-    for (int x = 0; x < m_widths[0]; ++x) {
-      count++;
-      if (newThreshold < vvitmp[y][x])
-        m_edges[0][count] = (unsigned char)255;
-      else
-        m_edges[0][count] = (unsigned char)0;
-
-    }
+  for (int i = 0; i < size; ++i) {
+    if (newThreshold < vitmp[i])
+      m_edges[level][i] = (unsigned char)255;
+    else
+      m_edges[level][i] = (unsigned char)0;
   }
   buildEdge();
 }
@@ -657,7 +957,8 @@ my_error_exit (j_common_ptr cinfo)
 
 int Cimage::readJpegImage(const std::string file,
 			  std::vector<unsigned char>& image,
-			  int& width, int& height, const int fast) {
+			  int& width, int& height, const int fast,
+			  const int level) {
   if (file.substr(file.length() - 3, file.length()) != "jpg")
     return 0;
 
@@ -666,8 +967,6 @@ int Cimage::readJpegImage(const std::string file,
   struct jpeg_decompress_struct cinfo;
   struct my_error_mgr jerr;
   FILE * infile;		/* source file */
-  JSAMPARRAY buffer;		/* Output row buffer */
-  int row_stride;		/* physical row width in output buffer */
 
   if ((infile = fopen(file.c_str(), "rb")) == NULL) {
     fprintf(stderr, "can't open %s\n", file.c_str());
@@ -687,59 +986,58 @@ int Cimage::readJpegImage(const std::string file,
   jpeg_create_decompress(&cinfo);
   jpeg_stdio_src(&cinfo, infile);
   (void) jpeg_read_header(&cinfo, TRUE);
-  (void) jpeg_start_decompress(&cinfo);
-
-  /* We may need to do some setup of our own at this point before reading
-   * the data.  After jpeg_start_decompress() we have the correct scaled
-   * output image dimensions available, as well as the output colormap
-   * if we asked for color quantization.
-   * In this example, we need to make an output work buffer of the right size.
-   */
-  /* JSAMPLEs per row in output buffer */
-  row_stride = cinfo.output_width * cinfo.output_components;
-  const int component = cinfo.output_components;
-
-  buffer = (*cinfo.mem->alloc_sarray)
-    ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
 
-  width = cinfo.output_width;
-  height = cinfo.output_height;
+  width = cinfo.image_width;
+  height = cinfo.image_height;
 
   if (fast) {
     image.clear();
-    //(void) jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
     fclose(infile);
     return 1;
   }
 
-  std::vector<unsigned char> imagetmp;
-  imagetmp.resize(height * row_stride);
-  while (cinfo.output_scanline < cinfo.output_height) {
-    /* jpeg_read_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could ask for
-     * more than one scanline at a time if that's more convenient.
-     */
-    (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-
-    for (int i = 0; i < row_stride; ++i)
-      imagetmp[(cinfo.output_scanline - 1) * row_stride + i] = (unsigned char)buffer[0][i];
-  }
-  (void) jpeg_finish_decompress(&cinfo);
-  jpeg_destroy_decompress(&cinfo);
-  fclose(infile);
+  // Let libjpeg scale in the DCT domain. It rounds the size up while the
+  // pyramid rounds it down, so an extra row or column may be cropped.
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1 << level;
+  (void) jpeg_start_decompress(&cinfo);
 
-  int count = 0;
-  image.clear();
-  // Pierre Moulon (Optimize JPEG data copy to internal image structure)
-  if ( component == 3 || component == 1)  {
-    image = imagetmp;
-  }
-  else
-  {
+  const int component = cinfo.output_components;
+  if (component != 3 && component != 1) {
     cerr << "Cannot handle this component. Component num is " << component << endl;
     exit (1);
   }
+
+  const int lwidth = width >> level;
+  const int lheight = height >> level;
+  const int row_stride = cinfo.output_width * component;
+  const int lrow_stride = lwidth * component;
+
+  // Scanlines go straight into the destination unless a column is cropped
+  std::vector<unsigned char> imagetmp;
+  std::vector<unsigned char>& target = (lrow_stride == row_stride) ? image : imagetmp;
+  target.resize(cinfo.output_height * row_stride);
+
+  std::vector<JSAMPROW> rows(cinfo.output_height);
+  for (int y = 0; y < (int)cinfo.output_height; ++y)
+    rows[y] = &target[y * row_stride];
+
+  while ((int)cinfo.output_scanline < lheight)
+    (void) jpeg_read_scanlines(&cinfo, &rows[cinfo.output_scanline],
+                               lheight - cinfo.output_scanline);
+
+  if (cinfo.output_scanline == cinfo.output_height)
+    (void) jpeg_finish_decompress(&cinfo);
+  else
+    jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(infile);
+
+  image.resize(lheight * lrow_stride);
+  if (&target != &image)
+    for (int y = 0; y < lheight; ++y)
+      memcpy(&image[y * lrow_stride], &imagetmp[y * row_stride], lrow_stride);
   return 1;
 }
 
@@ -880,120 +1178,214 @@ void Cimage::gray2rgb(const float gray, float& r, float& g, float& b) {
   }
 }
 
-// Some low-level image processing
-// 2D convolution with twice 1D gaussian convolution.
-void Cimage::filterG(const std::vector<float>& filter,
-                     std::vector<std::vector<float> >& data) {
-  vector<vector<float> > buffer;
-  const int height = (int)data.size();
-  const int width = (int)data[0].size();
-  buffer.resize(height);
-  for (int y = 0; y < height; ++y)
-    buffer[y].resize(width);
-  filterG(filter, data, buffer);
+namespace {
+// dst[i] is the sum of filter[j] * src[i + (j - margin) * step] over the
+// taps, for count consecutive i. The taps must all be inside the data.
+void convolveLine(const float* src, const int step,
+                  const std::vector<float>& filter, const int count,
+                  float* dst) {
+  const int size = (int)filter.size();
+  const float* first = src - size / 2 * step;
+  int i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= count; i += 8) {
+    const float* tap = first + i;
+    __m256 sum = _mm256_setzero_ps();
+    for (int j = 0; j < size; ++j, tap += step)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(filter[j]), _mm256_loadu_ps(tap)));
+    _mm256_storeu_ps(dst + i, sum);
+  }
+#endif
+#ifdef PMVS_SSE2
+  for (; i + 4 <= count; i += 4) {
+    const float* tap = first + i;
+    __m128 sum = _mm_setzero_ps();
+    for (int j = 0; j < size; ++j, tap += step)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(filter[j]), _mm_loadu_ps(tap)));
+    _mm_storeu_ps(dst + i, sum);
+  }
+#endif
+  for (; i < count; ++i) {
+    const float* tap = first + i;
+    float sum = 0.0f;
+    for (int j = 0; j < size; ++j, tap += step)
+      sum += filter[j] * *tap;
+    dst[i] = sum;
+  }
 }
 
-void Cimage::filterG(const std::vector<float>& filter,
-                     const int width, const int height,
-                     std::vector<float>& data) {
-  vector<float> buffer;
-  buffer.resize(width * height);
-  filterG(filter, width, height, data, buffer);
+// Element index of a line of length elements spaced by step, with the
+// taps out of the line moved to its ends
+float convolveClamped(const float* src, const int step, const int length,
+                      const std::vector<float>& filter, const int index) {
+  const int margin = (int)filter.size() / 2;
+  float sum = 0.0f;
+  for (int j = 0; j < (int)filter.size(); ++j) {
+    const int itmp = min(length - 1, max(0, index + j - margin));
+    sum += filter[j] * src[itmp * step];
+  }
+  return sum;
 }
 
-void Cimage::filterG(const std::vector<float>& filter,
-                     const int width, const int height,
-                     std::vector<float>& data,
-                     std::vector<float>& buffer) {
-  if ((int)filter.size() % 2 == 0) {
-    cerr << "Filter must have an odd length" << endl;
-    exit (1);
-  }
+// Same, but the taps out of the line are dropped and the weights of the
+// others renormalized
+float convolveNormalized(const float* src, const int step, const int length,
+                         const std::vector<float>& filter, const int index) {
   const int margin = (int)filter.size() / 2;
+  float sum = 0.0f;
+  float denom = 0.0f;
+  for (int j = 0; j < (int)filter.size(); ++j) {
+    const int itmp = index + j - margin;
+    if (itmp < 0 || length <= itmp)
+      continue;
+    sum += filter[j] * src[itmp * step];
+    denom += filter[j];
+  }
+  return sum / denom;
+}
 
-  // vertical smooth
-  int index = -1;
+// Zeroes the pixels of data that are outside the spans
+void clearOutside(const std::vector<int>& spans, const int width,
+                  const int height, const int channels,
+                  std::vector<float>& data) {
+  int pos = 0;
+  for (int s = 0; s < (int)spans.size(); s += 3) {
+    const int begin = spans[s] * width + spans[s + 1];
+    fill(data.begin() + pos * channels, data.begin() + begin * channels, 0.0f);
+    pos = spans[s] * width + spans[s + 2];
+  }
+  fill(data.begin() + pos * channels, data.begin() + width * height * channels, 0.0f);
+}
+}
+
+void Cimage::maskSpans(const std::vector<unsigned char>& mask,
+                       const int width, const int height,
+                       std::vector<int>& spans) {
+  spans.clear();
   for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      ++index;
-      buffer[index] = 0.0f;
-      float denom = 0.0f;
-      int index1 = index - (margin + 1) * width;
-      for (int j = -margin; j <= margin; ++j) {
-        index1 += width;
-        const int ytmp = y + j;
-        if (ytmp < 0 || height <= ytmp)
-          continue;
-        buffer[index] += filter[j + margin] * data[index1];
-        denom += filter[j + margin];
-      }
-      buffer[index] /= denom;
+    if (mask.empty()) {
+      spans.push_back(y);  spans.push_back(0);  spans.push_back(width);
+      continue;
+    }
+    const unsigned char* row = &mask[y * width];
+    int x = 0;
+    while (x < width) {
+      while (x < width && row[x] == 0)
+        ++x;
+      if (x == width)
+        break;
+      const int begin = x;
+      while (x < width && row[x] != 0)
+        ++x;
+      spans.push_back(y);  spans.push_back(begin);  spans.push_back(x);
     }
   }
-  // horizontal smooth
+}
+
+void Cimage::convolveX(const std::vector<float>& filter,
+                       const int width, const int height, const int channels,
+                       const std::vector<int>& spans,
+                       std::vector<float>& data, std::vector<float>& buffer) {
+  const int margin = (int)filter.size() / 2;
+  buffer.resize(data.size());
+  clearOutside(spans, width, height, channels, data);
+  clearOutside(spans, width, height, channels, buffer);
+
+  for (int s = 0; s < (int)spans.size(); s += 3) {
+    const float* src = &data[spans[s] * width * channels];
+    float* dst = &buffer[spans[s] * width * channels];
+    // Pixels whose taps are all inside the row
+    const int begin = spans[s + 1];
+    const int end = spans[s + 2];
+    const int ibegin = min(end, max(begin, margin));
+    const int iend = max(ibegin, min(end, width - margin));
+
+    for (int x = begin; x < ibegin; ++x)
+      for (int c = 0; c < channels; ++c)
+        dst[x * channels + c] = convolveClamped(src + c, channels, width, filter, x);
+    convolveLine(src + ibegin * channels, channels, filter,
+                 (iend - ibegin) * channels, dst + ibegin * channels);
+    for (int x = iend; x < end; ++x)
+      for (int c = 0; c < channels; ++c)
+        dst[x * channels + c] = convolveClamped(src + c, channels, width, filter, x);
+  }
   buffer.swap(data);
-  index = -1;
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      ++index;
-      buffer[index] = 0.0f;
-      float denom = 0.0f;
-      int index1 = index - (margin + 1);
-      for (int i = -margin; i <= margin; ++i) {
-        ++index1;
-        const int xtmp = x + i;
-        if (xtmp < 0 || width <= xtmp)
-          continue;
-        buffer[index] += filter[i + margin] * data[index1];
-        denom += filter[i + margin];
-      }
-      buffer[index] /= denom;
+}
+
+void Cimage::convolveY(const std::vector<float>& filter,
+                       const int width, const int height, const int channels,
+                       const std::vector<int>& spans,
+                       std::vector<float>& data, std::vector<float>& buffer) {
+  const int margin = (int)filter.size() / 2;
+  const int step = width * channels;
+  buffer.resize(data.size());
+  clearOutside(spans, width, height, channels, data);
+  clearOutside(spans, width, height, channels, buffer);
+
+  for (int s = 0; s < (int)spans.size(); s += 3) {
+    const int y = spans[s];
+    const int begin = spans[s + 1] * channels;
+    const int end = spans[s + 2] * channels;
+    if (margin <= y && y < height - margin) {
+      convolveLine(&data[y * step + begin], step, filter, end - begin,
+                   &buffer[y * step + begin]);
+      continue;
     }
+    for (int i = begin; i < end; ++i)
+      buffer[y * step + i] = convolveClamped(&data[i], step, height, filter, y);
   }
   buffer.swap(data);
 }
 
+// Some low-level image processing
+// 2D convolution with twice 1D gaussian convolution.
 void Cimage::filterG(const std::vector<float>& filter,
-                     std::vector<std::vector<float> >& data,
-                     std::vector<std::vector<float> >& buffer) {
+                     const int width, const int height,
+                     std::vector<float>& data) {
+  vector<float> buffer;
+  buffer.resize(width * height);
+  filterG(filter, width, height, data, buffer);
+}
+
+void Cimage::filterG(const std::vector<float>& filter,
+                     const int width, const int height,
+                     std::vector<float>& data,
+                     std::vector<float>& buffer) {
   if ((int)filter.size() % 2 == 0) {
     cerr << "Filter must have an odd length" << endl;
     exit (1);
   }
   const int margin = (int)filter.size() / 2;
-  const int height = (int)data.size();
-  const int width = (int)data[0].size();
+  float denom = 0.0f;
+  for (int j = 0; j < (int)filter.size(); ++j)
+    denom += filter[j];
 
   // vertical smooth
   for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      buffer[y][x] = 0.0f;
-      float denom = 0.0f;
-      for (int j = -margin; j <= margin; ++j) {
-        const int ytmp = y + j;
-        if (ytmp < 0 || height <= ytmp)
-          continue;
-        buffer[y][x] += filter[j + margin] * data[ytmp][x];
-        denom += filter[j + margin];
-      }
-      buffer[y][x] /= denom;
+    float* dst = &buffer[y * width];
+    if (margin <= y && y < height - margin) {
+      convolveLine(&data[y * width], width, filter, width, dst);
+      for (int x = 0; x < width; ++x)
+        dst[x] /= denom;
     }
+    else
+      for (int x = 0; x < width; ++x)
+        dst[x] = convolveNormalized(&data[x], width, height, filter, y);
   }
   // horizontal smooth
   buffer.swap(data);
+  const int ibegin = min(width, margin);
+  const int iend = max(ibegin, width - margin);
   for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      buffer[y][x] = 0.0f;
-      float denom = 0.0f;
-      for (int i = -margin; i <= margin; ++i) {
-        const int xtmp = x + i;
-        if (xtmp < 0 || width <= xtmp)
-          continue;
-        buffer[y][x] += filter[i + margin] * data[y][xtmp];
-        denom += filter[i + margin];
-      }
-      buffer[y][x] /= denom;
-    }
+    const float* src = &data[y * width];
+    float* dst = &buffer[y * width];
+    for (int x = 0; x < ibegin; ++x)
+      dst[x] = convolveNormalized(src, 1, width, filter, x);
+    convolveLine(src + ibegin, 1, filter, iend - ibegin, dst + ibegin);
+    for (int x = ibegin; x < iend; ++x)
+      dst[x] /= denom;
+    for (int x = iend; x < width; ++x)
+      dst[x] = convolveNormalized(src, 1, width, filter, x);
   }
   buffer.swap(data);
 }
@@ -4,20 +4,43 @@
 #include <string>
 #include <cstdlib>
 #include <cmath>
+#include <cstdint>
 
 #include "../numeric/vec3.h"
 
 namespace Image
 {
 
+// One level of an image pyramid. With m_tiles == 0, interleaved rgb rows of m_width pixels. Otherwise rgbx
+// tiles of 4 x 4 pixels, one cache line each, m_tiles to a row of tiles and with a border of one tile
+// repeating the pixels at the edge, so that pixels up to 4 outside of the image can be read.
+struct SimageView
+{
+    const unsigned char* m_pixels;
+    int m_width;
+    int m_height;
+    int m_tiles;
+
+    // Byte offset of pixel (x, y) from m_pixels
+    inline int offset(const int x, const int y) const
+    {
+        if (m_tiles == 0) return 3 * (y * m_width + x);
+        return (((y >> 2) * m_tiles + (x >> 2)) << 6) + ((y & 3) << 4) + ((x & 3) << 2);
+    }
+};
+
 class Cimage
 {
 public:
     Cimage() = default;
     virtual ~Cimage();
 
-    virtual void init(const std::string name, const std::string mname, const int maxLevel = 1);
-    virtual void init(const std::string name, const std::string mname, const std::string ename, const int maxLevel = 1);
+    // Levels finer than minLevel are never loaded. With cache, the pyramids are kept in a .pyr file next to the image.
+    // With layout 1, getView returns a tiled copy of each level, see SimageView.
+    virtual void init(const std::string name, const std::string mname, const int maxLevel = 1, const int minLevel = 0, const int cache = 0,
+                      const int layout = 0);
+    virtual void init(const std::string name, const std::string mname, const std::string ename, const int maxLevel = 1, const int minLevel = 0,
+                      const int cache = 0, const int layout = 0);
 
     void setEdge(const float threshold);
 
@@ -43,6 +66,11 @@ public:
     inline std::vector<unsigned char>& getMask(const int level);
     inline std::vector<unsigned char>& getEdge(const int level);
 
+    // Raw access for kernels sampling many pixels. Unlike getImage, nothing is checked.
+    inline SimageView getView(const int level) const;
+    // Bytes of the loaded image levels and their tiled copies
+    long long getImageBytes(void) const;
+
     inline int isSafe(const Vec3f& icoord, const int level) const;
     inline int isMask(void) const;        // Check if a mask image exists
     inline int isEdge(void) const;        // Check if an edge image exists
@@ -50,6 +78,7 @@ public:
     void alloc(const int fast = 0, const int filter = 0); // This function is also called when you call getColor/getMask when the memory is not allocated
     void free(void);
     void free(const int freeLevel);   // free memory below the specified level
+    void freeImage(void);             // free the image levels only, masks and edges stay. alloc reloads them.
 
     static int readPBMImage(const std::string file, std::vector<unsigned char>& image, int& width, int& height, const int fast);
     static int writePBMImage(const std::string file, std::vector<unsigned char>& image, int& width, int& height, const int fast);
@@ -60,7 +89,8 @@ public:
     static int readPPMImage(const std::string file, std::vector<unsigned char>& image, int& width, int& height, const int fast);
     static int writePPMImage(const std::string file, const std::vector<unsigned char>& image, const int width, const int height);
 
-    static int readJpegImage(const std::string file, std::vector<unsigned char>& image, int& width, int& height, const int fast);
+    // Decodes at 1/2^level of the full size (level <= 3), width and height are the full size
+    static int readJpegImage(const std::string file, std::vector<unsigned char>& image, int& width, int& height, const int fast, const int level = 0);
 
     static void writeJpegImage(const std::string filename, const std::vector<unsigned char>& buffer, const int width, const int height, const int flip = 0);
 
@@ -79,10 +109,20 @@ public:
     // Create a 1d gaussian filter based on sigma
     static void createFilter(const float sigma, std::vector<float>& filter);
 
-    static void filterG(const std::vector<float>& filter, std::vector<std::vector<float> >& data);
-    static void filterG(const std::vector<float>& filter, std::vector<std::vector<float> >& data, std::vector<std::vector<float> >& buffer);
     static void filterG(const std::vector<float>& filter, const int width, const int height, std::vector<float>& data);
-    static void filterG(const std::vector<float>& filter, const int width, const int height, std::vector<float>& data, std::vector<float>& buffer);                      
+    static void filterG(const std::vector<float>& filter, const int width, const int height, std::vector<float>& data, std::vector<float>& buffer);
+
+    // Runs of nonzero pixels of a width x height mask, as (y, begin, end) triples in row order.
+    // An empty mask gives a run per row.
+    static void maskSpans(const std::vector<unsigned char>& mask, const int width, const int height, std::vector<int>& spans);
+
+    // 1d convolution along x or y of a row-major image with channels floats per pixel. Taps
+    // past the border repeat the border pixel. Pixels outside the spans are set to 0, before
+    // the convolution in data and after it in the result.
+    static void convolveX(const std::vector<float>& filter, const int width, const int height, const int channels,
+                          const std::vector<int>& spans, std::vector<float>& data, std::vector<float>& buffer);
+    static void convolveY(const std::vector<float>& filter, const int width, const int height, const int channels,
+                          const std::vector<int>& spans, std::vector<float>& data, std::vector<float>& buffer);
 
     // non maximum surpression
     static void nms(std::vector<std::vector<float> >& data);
@@ -91,19 +131,31 @@ public:
 protected:
     static void completeName(const std::string& lhs, std::string& rhs, const int color);    // complete the name of an image file
 
+    int readImage(const int fast);
+    void allocImage(const int filter);
+
     void buildImageMaskEdge(const int filter);
     void buildImage(const int filter);
     void buildMask(void);
     void buildEdge(void);
+    void buildTiles(void);
+
+    // Pyramid cache file, valid while the image, mask, edge files and the levels are unchanged
+    std::string cacheName(void) const;
+    void cacheHeader(const int filter, long long header[]) const;
+    int readCache(const int filter, const int imageOnly = 0);
+    void writeCache(const int filter) const;
 
     //----------------------------------------------------------------------
     // Variables updated at every alloc/free
     //----------------------------------------------------------------------  
-    int m_alloc = 0;                                    // 0: nothing allocated; 1: width/height allocated; 2: memory allocated
+    int m_alloc = 0;                                    // 0: nothing allocated; 1: width/height allocated; 2: memory allocated; 3: all but the images
     std::vector<std::vector<unsigned char>> m_images;   // a pyramid of images
     std::vector<std::vector<unsigned char>> m_masks;    // a pyramid of masks
     std::vector<std::vector<unsigned char>> m_edges;    // a pyramid of images specifying regions with edges(texture)
 
+    std::vector<std::vector<unsigned char>> m_tiles;    // tiled copies of the image levels, with m_layout 1
+
     std::vector<int> m_widths;      // width of an image in each level
     std::vector<int> m_heights;     // height of an image in each level
 
@@ -114,6 +166,9 @@ protected:
     std::string m_mname;      // a name of a mask image
     std::string m_ename;      // a name of an image specifying regions with edges(texture)
     int m_maxLevel;           // number of levels
+    int m_minLevel = 0;       // finest level kept, the finer ones stay empty
+    int m_cache = 0;          // read and write the pyramid cache file
+    int m_layout = 0;         // 1: keep a tiled copy of each image level for getView
 };
 
 inline int Cimage::isSafe(const Vec3f& icoord, const int level) const
@@ -124,13 +179,13 @@ inline int Cimage::isSafe(const Vec3f& icoord, const int level) const
 
 inline int Cimage::isMask(void) const
 {
-    if (m_masks[0].empty()) return 0;
+    if (m_masks[m_minLevel].empty()) return 0;
     else                    return 1;
 };
 
 inline int Cimage::isEdge(void) const
 {
-    if (m_edges[0].empty()) return 0;
+    if (m_edges[m_minLevel].empty()) return 0;
     else                    return 1;
 };
 
@@ -147,7 +202,7 @@ inline const std::vector<unsigned char>& Cimage::getImage(const int level) const
 
 inline const std::vector<unsigned char>& Cimage::getMask(const int level) const
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -158,7 +213,7 @@ inline const std::vector<unsigned char>& Cimage::getMask(const int level) const
 
 inline const std::vector<unsigned char>& Cimage::getEdge(const int level) const
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -180,7 +235,7 @@ inline std::vector<unsigned char>& Cimage::getImage(const int level)
 
 inline std::vector<unsigned char>& Cimage::getMask(const int level)
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -191,7 +246,7 @@ inline std::vector<unsigned char>& Cimage::getMask(const int level)
 
 inline std::vector<unsigned char>& Cimage::getEdge(const int level)
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -200,6 +255,25 @@ inline std::vector<unsigned char>& Cimage::getEdge(const int level)
     return m_edges[level];
 };
 
+SimageView Cimage::getView(const int level) const
+{
+    SimageView view;
+    view.m_width  = m_widths[level];
+    view.m_height = m_heights[level];
+    if (m_tiles.empty() || m_tiles[level].empty())
+    {
+        view.m_pixels = m_images[level].data();
+        view.m_tiles  = 0;
+    } else
+    {
+        // The tiles start at the first cache line of the buffer, the pixels past the border tiles above and on the left
+        const unsigned char* tiles = m_tiles[level].data() + (-(std::uintptr_t)m_tiles[level].data() & 63);
+        view.m_tiles  = (m_widths[level] + 3) / 4 + 2;
+        view.m_pixels = tiles + 64 * (view.m_tiles + 1);
+    }
+    return view;
+};
+
 int Cimage::getWidth(const int level) const
 {
     if (m_alloc == 0)
@@ -267,7 +341,7 @@ Vec3f Cimage::getColor(const int ix, const int iy, const int level) const
 
 int Cimage::getMask(const float fx, const float fy, const int level) const
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -282,7 +356,7 @@ int Cimage::getMask(const float fx, const float fy, const int level) const
 
 int Cimage::getMask(const int ix, const int iy, const int level) const
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -298,7 +372,7 @@ int Cimage::getMask(const int ix, const int iy, const int level) const
 
 int Cimage::getEdge(const float fx, const float fy, const int level) const
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
@@ -314,7 +388,7 @@ int Cimage::getEdge(const float fx, const float fy, const int level) const
 
 int Cimage::getEdge(const int ix, const int iy, const int level) const
 {
-    if (m_alloc != 2)
+    if (m_alloc < 2)
     {
         std::cerr << "First allocate" << std::endl;
         exit (1);
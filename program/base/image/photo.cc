@@ -12,15 +12,17 @@ Cphoto::~Cphoto()
 {
 }
 
-void Cphoto::init(const std::string name, const std::string mname, const std::string cname, const int maxLevel)
+void Cphoto::init(const std::string name, const std::string mname, const std::string cname, const int maxLevel, const int minLevel, const int cache,
+                  const int layout)
 {
-    Cimage::init(name, mname, maxLevel);
+    Cimage::init(name, mname, maxLevel, minLevel, cache, layout);
     Ccamera::init(cname, maxLevel);
 }
 
-void Cphoto::init(const std::string name, const std::string mname, const std::string ename, const std::string cname, const int maxLevel)
+void Cphoto::init(const std::string name, const std::string mname, const std::string ename, const std::string cname, const int maxLevel, const int minLevel, const int cache,
+                  const int layout)
 {
-    Cimage::init(name, mname, ename, maxLevel);
+    Cimage::init(name, mname, ename, maxLevel, minLevel, cache, layout);
     Ccamera::init(cname, maxLevel);
 }
 
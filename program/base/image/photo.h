@@ -14,9 +14,11 @@ public:
     Cphoto(void);
     virtual ~Cphoto();
 
-    virtual void init(const std::string name, const std::string mname, const std::string cname, const int maxLevel = 1);
+    virtual void init(const std::string name, const std::string mname, const std::string cname, const int maxLevel = 1, const int minLevel = 0, const int cache = 0,
+                      const int layout = 0);
 
-    virtual void init(const std::string name, const std::string mname, const std::string ename, const std::string cname, const int maxLevel = 1);
+    virtual void init(const std::string name, const std::string mname, const std::string ename, const std::string cname, const int maxLevel = 1, const int minLevel = 0, const int cache = 0,
+                      const int layout = 0);
 
     void grabTex(const int level, const Vec2f& icoord, const Vec2f& xaxis, const Vec2f& yaxis, 
                  const int size, std::vector<Vec3f>& tex, const int normalizef = 1) const;
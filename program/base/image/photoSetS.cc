@@ -1,5 +1,6 @@
 #include <fstream>
 #include <algorithm>
+#include <thread>
 #include "photoSetS.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -15,7 +16,9 @@ CphotoSetS::~CphotoSetS() {
 
 
 void CphotoSetS::init(const std::vector<int>& images, const std::string prefix,
-                      const int maxLevel, const int size, const int alloc) {
+                      const int maxLevel, const int size, const int alloc,
+                      const int minLevel, const int CPU, const int cache,
+                      const long long budget, const int layout) {
   m_images = images;
   m_num = (int)images.size();
   
@@ -25,70 +28,148 @@ void CphotoSetS::init(const std::vector<int>& images, const std::string prefix,
   m_prefix = prefix;
   m_maxLevel = max(1, maxLevel);
   m_photos.resize(m_num);
+
+  m_budget = max(0LL, budget);
+  m_photoLocks.resize(m_num);
+  m_pins.assign(m_num, 0);
+  m_loaded.assign(m_num, 0);
+  m_bytes.assign(m_num, 0);
+  m_lru.clear();
+  m_lruPos.resize(m_num);
+  m_resident = 0;
+
   cerr << "Reading images: " << flush;
-  for (int index = 0; index < m_num; ++index) {
-    const int image = m_images[index];
 
-    char test0[1024], test1[1024];
-    sprintf(test0, "%svisualize/%08d.ppm", prefix.c_str(), image);
-    sprintf(test1, "%svisualize/%08d.jpg", prefix.c_str(), image);
-    if (ifstream(test0) || ifstream(test1)) {
-      char name[1024], mname[1024], ename[1024], cname[1024];    
-      
-      // Set name
-      sprintf(name, "%svisualize/%08d", prefix.c_str(), image);
-      sprintf(mname, "%smasks/%08d", prefix.c_str(), image);
-      sprintf(ename, "%sedges/%08d", prefix.c_str(), image);
-      sprintf(cname, "%stxt/%08d.txt", prefix.c_str(), image);
-      
-      m_photos[index].init(name, mname, ename, cname, m_maxLevel);        
-      if (alloc)
-        m_photos[index].alloc();
-      else
-        m_photos[index].alloc(1);
-      cerr << '*' << flush;
-    }
-    // try 4 digits
-    else {
-      char name[1024], mname[1024], ename[1024], cname[1024];    
-      
-      // Set name
-      sprintf(name, "%svisualize/%04d", prefix.c_str(), image);
-      sprintf(mname, "%smasks/%04d", prefix.c_str(), image);
-      sprintf(ename, "%sedges/%04d", prefix.c_str(), image);
-      sprintf(cname, "%stxt/%04d.txt", prefix.c_str(), image);
-      
-      m_photos[index].init(name, mname, ename, cname, m_maxLevel);        
-      if (alloc)
-        m_photos[index].alloc();
-      else
-        m_photos[index].alloc(1);
-      cerr << '*' << flush;
-    }
+  // Images are decoded and their pyramids built independently
+  m_initJob = 0;
+  m_initAlloc = alloc;
+  m_initMinLevel = minLevel;
+  m_initCache = cache;
+  m_initLayout = layout;
+  vector<thread> threads(max(1, min(CPU, m_num)));
+  for (auto& t : threads) t = thread(&CphotoSetS::initThread, this);
+  for (auto& t : threads) t.join();
 
-    /*
-    const int image = m_images[index];
-    char name[1024], mname[1024], ename[1024], cname[1024];
-
-    // Set name
-    sprintf(name, "%svisualize/%08d", prefix.c_str(), image);
-    sprintf(mname, "%smasks/%08d", prefix.c_str(), image);
-    sprintf(ename, "%sedges/%08d", prefix.c_str(), image);
-    sprintf(cname, "%stxt/%08d.txt", prefix.c_str(), image);
-
-    m_photos[index].init(name, mname, ename, cname, m_maxLevel);        
-    if (alloc)
-      m_photos[index].alloc();
-    else
-      m_photos[index].alloc(1);
-    cerr << '*' << flush;
-    */
-  }
   cerr << endl;
   const int margin = size / 2;
   m_size = 2 * margin + 1;
 }
 
+void CphotoSetS::initThread(void) {
+  while (1) {
+    int index;
+    {
+      lock_guard<mutex> lock(m_initLock);
+      index = m_initJob++;
+    }
+    if (m_num <= index)
+      break;
+
+    initPhoto(index);
+
+    lock_guard<mutex> lock(m_initLock);
+    cerr << '*' << flush;
+  }
+}
+
+void CphotoSetS::initPhoto(const int index) {
+  const int image = m_images[index];
+
+  // 8 digits, otherwise try 4 digits
+  const char* format = "%s%s/%04d%s";
+  char test0[1024], test1[1024];
+  sprintf(test0, "%svisualize/%08d.ppm", m_prefix.c_str(), image);
+  sprintf(test1, "%svisualize/%08d.jpg", m_prefix.c_str(), image);
+  if (ifstream(test0) || ifstream(test1))
+    format = "%s%s/%08d%s";
+
+  char name[1024], mname[1024], ename[1024], cname[1024];
+
+  // Set name
+  sprintf(name, format, m_prefix.c_str(), "visualize", image, "");
+  sprintf(mname, format, m_prefix.c_str(), "masks", image, "");
+  sprintf(ename, format, m_prefix.c_str(), "edges", image, "");
+  sprintf(cname, format, m_prefix.c_str(), "txt", image, ".txt");
+
+  m_photos[index].init(name, mname, ename, cname, m_maxLevel, m_initMinLevel, m_initCache,
+                       m_initLayout);
+  if (m_initAlloc)
+    m_photos[index].alloc();
+  else
+    m_photos[index].alloc(1);
+
+  if (m_budget && m_initAlloc) {
+    lock_guard<mutex> lock(m_residencyLock);
+    touch(index);
+    evict();
+  }
+}
+
+void CphotoSetS::pin(const int index) {
+  if (m_budget == 0)
+    return;
+
+  // Loaded under the lock of the image only, so that images load in parallel
+  lock_guard<mutex> photoLock(m_photoLocks[index]);
+  if (!m_loaded[index])
+    m_photos[index].alloc();
+
+  lock_guard<mutex> lock(m_residencyLock);
+  ++m_pins[index];
+  touch(index);
+  evict();
+}
+
+void CphotoSetS::unpin(const int index) {
+  if (m_budget == 0)
+    return;
+
+  lock_guard<mutex> lock(m_residencyLock);
+  --m_pins[index];
+}
+
+void CphotoSetS::pin(const std::vector<int>& indexes) {
+  for (int i = 0; i < (int)indexes.size(); ++i)
+    pin(indexes[i]);
+}
+
+void CphotoSetS::unpin(const std::vector<int>& indexes) {
+  for (int i = 0; i < (int)indexes.size(); ++i)
+    unpin(indexes[i]);
+}
+
+// Marks a loaded image as the most recently used. m_residencyLock is held.
+void CphotoSetS::touch(const int index) {
+  if (m_loaded[index]) {
+    m_lru.splice(m_lru.begin(), m_lru, m_lruPos[index]);
+    return;
+  }
+
+  m_bytes[index] = m_photos[index].getImageBytes();
+  m_loaded[index] = 1;
+  m_resident += m_bytes[index];
+  m_lru.push_front(index);
+  m_lruPos[index] = m_lru.begin();
+}
+
+// Frees the least recently used images until the budget is met. Pinned
+// images and images being loaded are skipped. m_residencyLock is held.
+void CphotoSetS::evict(void) {
+  list<int>::iterator it = m_lru.end();
+  while (m_budget < m_resident && it != m_lru.begin()) {
+    --it;
+    const int index = *it;
+    if (m_pins[index] || !m_photoLocks[index].try_lock())
+      continue;
+
+    m_photos[index].freeImage();
+    m_loaded[index] = 0;
+    m_resident -= m_bytes[index];
+    it = m_lru.erase(it);
+    m_photoLocks[index].unlock();
+  }
+}
+
 void CphotoSetS::free(void) {
   for (int index = 0; index < (int)m_photos.size(); ++index)
     m_photos[index].free();
@@ -100,8 +181,11 @@ void CphotoSetS::free(const int level) {
 }
 
 void CphotoSetS::setEdge(const float threshold) {
-  for (int index = 0; index < m_num; ++index)
+  for (int index = 0; index < m_num; ++index) {
+    pin(index);
     m_photos[index].setEdge(threshold);
+    unpin(index);
+  }
 }
 
 void CphotoSetS::write(const std::string outdir) {
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <map>
+#include <mutex>
+#include <list>
+#include <deque>
 
 #include "photo.h"
 
@@ -13,7 +16,19 @@ public:
     CphotoSetS();
     virtual ~CphotoSetS();
 
-    void init(const std::vector<int>& images, const std::string prefix, const int maxLevel, const int size, const int alloc);
+    // Loads the images with CPU threads. Levels finer than minLevel are not loaded.
+    // With cache, the pyramids are read from and written to visualize/*.pyr.
+    // With a budget in bytes, only the recently used images are kept, see pin. With layout 1, the texture
+    // kernels read tiled copies of the image levels, see Cimage::getView.
+    void init(const std::vector<int>& images, const std::string prefix, const int maxLevel, const int size, const int alloc,
+              const int minLevel = 0, const int CPU = 1, const int cache = 0, const long long budget = 0, const int layout = 0);
+
+    // Under a budget, images are loaded while pinned. The least recently used images that are not pinned are
+    // freed when the loaded ones exceed the budget. Masks and edges are always kept. Without a budget these do nothing.
+    void pin(const int index);
+    void unpin(const int index);
+    void pin(const std::vector<int>& indexes);
+    void unpin(const std::vector<int>& indexes);
 
     // grabTex given 2D sampling information
     void grabTex(const int index, const int level, const Vec2f& icoord, const Vec2f& xaxis, const Vec2f& yaxis,
@@ -65,12 +80,38 @@ public:
     int m_num;              // Number of cameras
     int m_maxLevel;
     int m_size;             // Window size used to refine location
+    long long m_budget;     // Bytes of images kept loaded, 0 keeps all of them
 
     void getPAxes(const int index, const Vec4f& coord, const Vec4f& normal, Vec4f& pxaxis, Vec4f& pyaxis) const;
 
     // Pairwise distance based on optical center and viewing direction
     void setDistances(void);
     std::vector<std::vector<float>> m_distances;
+
+protected:
+    void initThread(void);
+    void initPhoto(const int index);
+
+    // Next image to load by init, and the arguments of init
+    std::mutex m_initLock;
+    int m_initJob;
+    int m_initAlloc;
+    int m_initMinLevel;
+    int m_initCache;
+    int m_initLayout;
+
+    // Residency of the images under m_budget. m_residencyLock guards all but the loading itself, which holds
+    // the lock of the image.
+    void touch(const int index);
+    void evict(void);
+    std::mutex m_residencyLock;
+    std::deque<std::mutex> m_photoLocks;
+    std::vector<int> m_pins;
+    std::vector<char> m_loaded;
+    std::vector<long long> m_bytes;
+    std::list<int> m_lru;                               // Loaded images, most recently used first
+    std::vector<std::list<int>::iterator> m_lruPos;
+    long long m_resident;
 }; 
 
 Vec3f CphotoSetS::project(const int index, const Vec4f& coord, const int level) const
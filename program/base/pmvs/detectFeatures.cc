@@ -1,7 +1,11 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <numeric>
 #include <thread>
+#include <random>
+#include <cstdio>
+#include <cstring>
 
 #include "../image/image.h"
 #include "detectFeatures.h"
@@ -12,11 +16,36 @@
 using namespace PMVS3;
 using namespace Image;
 
-void CdetectFeatures::run(const CphotoSetS& pss, const int num, const int csize, const int level, const int CPU)
+namespace
+{
+const float sigma      = 4.0f;  // Parameters for harris...
+const float firstScale = 1.0f;  // ... for DoG
+const float lastScale  = 3.0f;  // ... for DoG
+
+const char cacheMagic[8] = {'P', 'M', 'V', 'S', 'F', 'T', 'R', '1'};
+
+// 64 bit FNV-1a
+void hashBytes(const void* data, const size_t size, unsigned long long& hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+}
+};
+
+void CdetectFeatures::run(CphotoSetS& pss, const int num, const int csize, const int level, const int CPU, const int gray,
+                          const int cache)
 {
     m_ppss = &pss;
     m_csize = csize;
     m_level = level;
+    m_gray = gray;
+    m_cache = cache;
+    m_hits = m_misses = 0;
+    m_running = 0;
     m_CPU = CPU;
 
     m_points.clear();
@@ -29,6 +58,8 @@ void CdetectFeatures::run(const CphotoSetS& pss, const int num, const int csize,
     for (auto& t : threads) t.join();
 
     std::cerr << "done" << std::endl;
+    if (m_cache)
+        std::cerr << "Feature cache: " << m_hits << " hits, " << m_misses << " misses" << std::endl;
 }
 
 void CdetectFeatures::runThread()
@@ -36,12 +67,16 @@ void CdetectFeatures::runThread()
     while (1)
     {
         int index = -1;
+        int bands = 1;
         {
             std::lock_guard<std::mutex> lock(m_rwlock);
             if (!m_jobs.empty())
             {
                 index = m_jobs.front();
                 m_jobs.pop_front();
+                // Cores left idle by the images being detected go to bands of this one
+                ++m_running;
+                bands = std::max(1, m_CPU / std::min(m_CPU, m_running + (int)m_jobs.size()));
             }
         }
 
@@ -50,35 +85,145 @@ void CdetectFeatures::runThread()
         const int image = m_ppss->m_images[index];
         std::cerr << image << ' ' << std::flush;
 
-        const float sigma      = 4.0f;  // Parameters for harris...
-        const float firstScale = 1.0f;  // ... for DoG
-        const float lastScale  = 3.0f;  // ... for DoG
+        // Converted once for both detectors
+        SdetectorImage dimage;
+        unsigned long long key = 0;
+        m_ppss->pin(index);
+        const std::vector<unsigned char>& pixels = m_ppss->m_photos[index].getImage(m_level);
+        const std::vector<unsigned char>& mask   = m_ppss->m_photos[index].Cimage::getMask(m_level);
+        const std::vector<unsigned char>& edge   = m_ppss->m_photos[index].Cimage::getEdge(m_level);
+        const int width  = m_ppss->m_photos[index].getWidth(m_level);
+        const int height = m_ppss->m_photos[index].getHeight(m_level);
+        if (m_cache)
+        {
+            key = cacheKey(pixels, mask, edge, width, height);
+            if (readCache(index, key))
+            {
+                m_ppss->unpin(index);
+                std::lock_guard<std::mutex> lock(m_rwlock);
+                ++m_hits;
+                --m_running;
+                continue;
+            }
+        }
+        dimage.init(pixels, mask, edge, width, height, m_gray);
+        m_ppss->unpin(index);
 
         // Harris
         {
             Charris harris;
-            std::multiset<Cpoint> result;
-            harris.run(m_ppss->m_photos[index].getImage(m_level),
-                       m_ppss->m_photos[index].Cimage::getMask(m_level),
-                       m_ppss->m_photos[index].Cimage::getEdge(m_level),
-                       m_ppss->m_photos[index].getWidth(m_level),
-                       m_ppss->m_photos[index].getHeight(m_level), m_csize, sigma, result);
-      
-            for (const auto& point : result) m_points[index].push_back(point);
+            harris.run(dimage, m_csize, sigma, m_points[index], bands);
         }
 
         // DoG
         {
             Cdog dog;
-            std::multiset<Cpoint> result;
-            dog.run(m_ppss->m_photos[index].getImage(m_level),
-                    m_ppss->m_photos[index].Cimage::getMask(m_level),
-                    m_ppss->m_photos[index].Cimage::getEdge(m_level),
-                    m_ppss->m_photos[index].getWidth(m_level),
-                    m_ppss->m_photos[index].getHeight(m_level),
-                    m_csize, firstScale, lastScale, result);
-
-            for (const auto& point : result) m_points[index].push_back(point);
+            dog.run(dimage, m_csize, firstScale, lastScale, m_points[index], bands);
         }
+
+        if (m_cache) writeCache(index, key);
+
+        std::lock_guard<std::mutex> lock(m_rwlock);
+        if (m_cache) ++m_misses;
+        --m_running;
+    }
+}
+
+unsigned long long CdetectFeatures::cacheKey(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask,
+                                             const std::vector<unsigned char>& edge, const int width, const int height) const
+{
+    // The features depend only on the pixels and the parameters of the detectors
+    unsigned long long hash = 14695981039346656037ULL;
+    const int params[4] = {width, height, m_csize, m_gray};
+    const float scales[3] = {sigma, firstScale, lastScale};
+    hashBytes(params, sizeof(params), hash);
+    hashBytes(scales, sizeof(scales), hash);
+    hashBytes(image.data(), image.size(), hash);
+    hashBytes(mask.data(), mask.size(), hash);
+    hashBytes(edge.data(), edge.size(), hash);
+    return hash;
+}
+
+std::string CdetectFeatures::cacheName(const int index) const
+{
+    char buffer[1024];
+    sprintf(buffer, "%svisualize/%08d.ftr", m_ppss->m_prefix.c_str(), m_ppss->m_images[index]);
+    return buffer;
+}
+
+int CdetectFeatures::readCache(const int index, const unsigned long long key)
+{
+    std::ifstream ifstr(cacheName(index).c_str(), std::ios::binary);
+    if (!ifstr) return 0;
+
+    char magic[8];
+    unsigned long long stored;
+    int count;
+    ifstr.read(magic, sizeof(magic));
+    ifstr.read((char*)&stored, sizeof(stored));
+    ifstr.read((char*)&count, sizeof(count));
+    if (!ifstr || memcmp(magic, cacheMagic, sizeof(magic)) != 0 || stored != key || count < 0) return 0;
+
+    // x, y, response and type per feature. A truncated or corrupted count is caught before allocating.
+    const std::streamoff begin = ifstr.tellg();
+    ifstr.seekg(0, std::ios::end);
+    const std::streamoff left = ifstr.tellg() - begin;
+    ifstr.seekg(begin);
+    if (!ifstr || (unsigned long long)left != 4 * (unsigned long long)count * sizeof(float)) return 0;
+
+    std::vector<float> values(4 * (size_t)count);
+    ifstr.read((char*)values.data(), values.size() * sizeof(float));
+    if (!ifstr) return 0;
+
+    m_points[index].resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        Cpoint& point = m_points[index][i];
+        const float* value = &values[4 * (size_t)i];
+        point.m_icoord = Vec3f(value[0], value[1], 1.0f);
+        point.m_response = value[2];
+        point.m_type = (int)value[3];
+    }
+    return 1;
+}
+
+void CdetectFeatures::writeCache(const int index, const unsigned long long key) const
+{
+    const std::string cname = cacheName(index);
+    // Written aside and renamed, so that concurrent runs never read a partially written file
+    char suffix[32];
+    sprintf(suffix, ".%08x", (unsigned int)std::random_device()());
+    const std::string tmp = cname + suffix;
+
+    std::ofstream ofstr(tmp.c_str(), std::ios::binary);
+    if (!ofstr) return;
+
+    const int count = (int)m_points[index].size();
+    std::vector<float> values(4 * (size_t)count);
+    for (int i = 0; i < count; ++i)
+    {
+        const Cpoint& point = m_points[index][i];
+        float* value = &values[4 * (size_t)i];
+        value[0] = point.m_icoord[0];
+        value[1] = point.m_icoord[1];
+        value[2] = point.m_response;
+        value[3] = (float)point.m_type;
+    }
+    ofstr.write(cacheMagic, sizeof(cacheMagic));
+    ofstr.write((const char*)&key, sizeof(key));
+    ofstr.write((const char*)&count, sizeof(count));
+    ofstr.write((const char*)values.data(), values.size() * sizeof(float));
+    ofstr.close();
+
+    if (!ofstr)
+    {
+        remove(tmp.c_str());
+        return;
+    }
+    // rename does not replace an existing file on every platform
+    if (rename(tmp.c_str(), cname.c_str()) != 0)
+    {
+        remove(cname.c_str());
+        if (rename(tmp.c_str(), cname.c_str()) != 0) remove(tmp.c_str());
     }
 }
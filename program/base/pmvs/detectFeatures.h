@@ -21,14 +21,20 @@ public:
     CdetectFeatures() = default;
     virtual ~CdetectFeatures() {}
 
-    void run(const Image::CphotoSetS& pss, const int num, const int csize, const int level, const int CPU = 1);
+    void run(Image::CphotoSetS& pss, const int num, const int csize, const int level, const int CPU = 1, const int gray = 0,
+             const int cache = 0);
 
     std::vector<std::vector<Cpoint>> m_points;
 
 protected:
-    const Image::CphotoSetS* m_ppss;
+    Image::CphotoSetS* m_ppss;
     int m_csize;
     int m_level;
+    int m_gray;
+    int m_cache;    // read and write the features in visualize/*.ftr
+    int m_hits;
+    int m_misses;
+    int m_running;  // images being detected
 
     std::mutex m_rwlock;
     int m_CPU;
@@ -36,6 +42,13 @@ protected:
     std::list<int> m_jobs;
 
     void runThread();
+
+    // Feature cache file, valid while its key matches
+    unsigned long long cacheKey(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask,
+                                const std::vector<unsigned char>& edge, const int width, const int height) const;
+    std::string cacheName(const int index) const;
+    int readCache(const int index, const unsigned long long key);
+    void writeCache(const int index, const unsigned long long key) const;
 };
 
 };
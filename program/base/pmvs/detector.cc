@@ -1,5 +1,5 @@
 #include <algorithm>
-#include <set>
+#include <functional>
 
 #include "point.h"
 #include "detector.h"
@@ -44,28 +44,118 @@ void Cdetector::setGaussI(const float sigmaI, std::vector<float>& gaussI)
     for (int x = 0; x < sizeI; ++x) gaussI[x] /= denom;
 }
 
-float Cdetector::setThreshold(std::multiset<Cpoint>& grid)
+void Cdetector::splitBands(const int height, const int count, const int gridsize, std::vector<int>& bounds)
 {
-    float ave   = 0.0;
-    float ave2  = 0.0;
-    auto  begin = grid.begin();
-    auto  end   = grid.end();
+    const int cells = (height + gridsize - 1) / gridsize;
+    const int bands = std::max(1, std::min(count, cells));
 
-    int count = 0;
-    while (begin != end)
+    bounds.resize(bands + 1);
+    for (int b = 0; b < bands; ++b) bounds[b] = std::min(height, cells * b / bands * gridsize);
+    bounds[bands] = height;
+}
+
+void CpointGrid::init(const int width, const int height, const int gridsize, const int capacity)
+{
+    m_width    = (width + gridsize - 1) / gridsize;
+    m_height   = (height + gridsize - 1) / gridsize;
+    m_gridsize = gridsize;
+    m_capacity = capacity;
+
+    m_entries.resize(m_width * m_height * m_capacity);
+    m_sizes.assign(m_width * m_height, 0);
+    m_added.assign(m_width * m_height, 0);
+}
+
+void CpointGrid::add(const int x, const int y, const float response, const int replace)
+{
+    const int cell = std::min(y / m_gridsize, m_height - 1) * m_width + std::min(x / m_gridsize, m_width - 1);
+    Sentry* heap = &m_entries[cell * m_capacity];
+    int& size = m_sizes[cell];
+
+    Sentry entry;
+    entry.m_response = response;
+    entry.m_order    = m_added[cell]++;
+    entry.m_x        = x;
+    entry.m_y        = y;
+
+    // The worst point kept is on top
+    if (size < m_capacity)
+    {
+        heap[size++] = entry;
+        std::push_heap(heap, heap + size, std::greater<Sentry>());
+    } else if (heap[0].m_response < response || (replace && heap[0].m_response == response))
+    {
+        std::pop_heap(heap, heap + size, std::greater<Sentry>());
+        heap[size - 1] = entry;
+        std::push_heap(heap, heap + size, std::greater<Sentry>());
+    }
+}
+
+void CpointGrid::collect(const int type, std::vector<Cpoint>& result) const
+{
+    const int first = (int)result.size();
+    std::vector<Sentry> cell;
+    for (int c = 0; c < (int)m_sizes.size(); ++c)
     {
-        count++;
-        ave  += begin->m_response;
-        ave2 += begin->m_response * begin->m_response;
-        begin++;
+        cell.assign(m_entries.begin() + c * m_capacity, m_entries.begin() + c * m_capacity + m_sizes[c]);
+        std::sort(cell.begin(), cell.end(), std::greater<Sentry>());
+        for (int i = (int)cell.size() - 1; 0 <= i; --i)
+        {
+            Cpoint p;
+            p.m_icoord = Vec3f((float)cell[i].m_x, (float)cell[i].m_y, 1.0f);
+            p.m_response = cell[i].m_response;
+            p.m_type = type;
+            result.push_back(p);
+        }
     }
+    // Ties stay in cell order
+    std::stable_sort(result.begin() + first, result.end());
+}
+
+void SdetectorImage::init(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge,
+                          const int width, const int height, const int gray)
+{
+    m_width    = width;
+    m_height   = height;
+    m_channels = gray ? 1 : 3;
 
-    if (count == 0)
-    count = 1;
-    ave  /= count;
-    ave2 /= count;
-    ave2  = sqrt(std::max(0.0f, ave2 - ave * ave));
-    const float threshold = ave + ave2;
+    const int size = m_width * m_height;
+    m_image.resize(size * m_channels);
+    if (gray)
+    {
+        for (int i = 0; i < size; ++i)
+            m_image[i] = (0.299f * image[3 * i] + 0.587f * image[3 * i + 1] + 0.114f * image[3 * i + 2]) / 255.0f;
+    } else
+    {
+        for (int i = 0; i < 3 * size; ++i) m_image[i] = ((int)image[i]) / 255.0f;
+    }
 
-    return threshold;
-}
\ No newline at end of file
+    m_mask.clear();
+    if (!mask.empty() || !edge.empty())
+    {
+        m_mask.resize(size);
+        for (int i = 0; i < size; ++i)
+        {
+            if (mask.empty())       m_mask[i] = edge[i];
+            else if (edge.empty())  m_mask[i] = mask[i];
+            else                    m_mask[i] = (mask[i] && edge[i]) ? (unsigned char)255 : 0;
+        }
+    }
+
+    Image::Cimage::maskSpans(m_mask, m_width, m_height, m_spans);
+}
+
+void SdetectorImage::init(const SdetectorImage& image, const int y0, const int y1)
+{
+    m_width    = image.m_width;
+    m_height   = y1 - y0;
+    m_channels = image.m_channels;
+
+    const int row = m_width * m_channels;
+    m_image.assign(image.m_image.begin() + y0 * row, image.m_image.begin() + y1 * row);
+    m_mask.clear();
+    if (!image.m_mask.empty())
+        m_mask.assign(image.m_mask.begin() + y0 * m_width, image.m_mask.begin() + y1 * m_width);
+
+    Image::Cimage::maskSpans(m_mask, m_width, m_height, m_spans);
+}
@@ -1,140 +1,100 @@
 #pragma once
 
 #include <vector>
+#include "../image/image.h"
 #include "point.h"
 
 namespace PMVS3
 {
 
-class Cdetector
+// An image converted for the detectors, shared by Harris and DoG
+struct SdetectorImage
+{
+    void init(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge,
+              const int width, const int height, const int gray);
+    // Rows y0 to y1 - 1 of image
+    void init(const SdetectorImage& image, const int y0, const int y1);
+
+    int                         m_width;
+    int                         m_height;
+    int                         m_channels; // 3, or 1 for the luminance
+    std::vector<float>          m_image;    // m_channels floats per pixel in [0, 1], row-major
+    std::vector<unsigned char>  m_mask;     // empty or a byte per pixel
+    std::vector<int>            m_spans;    // runs of m_mask, see Cimage::maskSpans
+};
+
+// Best points of each cell of a grid, kept in fixed size min heaps
+class CpointGrid
 {
 public:
-    static void setGaussD(const float sigmaD, std::vector<float>& gaussD);
-    static void setGaussI(const float sigmaI, std::vector<float>& gaussI);
-    virtual ~Cdetector() { }
+    void init(const int width, const int height, const int gridsize, const int capacity);
 
-protected:
-    static float setThreshold(std::multiset<Cpoint>& grid);
+    // Keeps the point at (x, y) if it is among the capacity best ones of its cell. With replace,
+    // a point as good as the worst one kept replaces it.
+    void add(const int x, const int y, const float response, const int replace);
 
-    int                                     m_width;
-    int                                     m_height;
-    std::vector<std::vector<Vec3f>>         m_image;
-    std::vector<std::vector<unsigned char>> m_mask;
+    // Appends the points of all the cells with type, by increasing response
+    void collect(const int type, std::vector<Cpoint>& result) const;
 
-public:
-    template <class T>
-    void convolveX(std::vector<std::vector<T>>& image, const std::vector<std::vector<unsigned char>>& mask, const std::vector<float>& filter, std::vector<std::vector<T>>& buffer)
+protected:
+    struct Sentry
     {
-        const int width = (int)image[0].size();
-        const int height = (int)image.size();
-        const int margin = ((int)filter.size()) / 2;
-    
-        for (int y = 0; y < height; ++y)
+        float m_response;
+        int   m_order;      // among the points added to the cell
+        int   m_x;
+        int   m_y;
+
+        bool operator > (const Sentry& rhs) const
         {
-            for (int x = 0; x < width; ++x)
-            {
-                buffer[y][x] *= 0.0;
+            return rhs.m_response < m_response || (m_response == rhs.m_response && rhs.m_order < m_order);
+        }
+    };
 
-                if (!mask.empty() && mask[y][x] == 0) continue;
+    int m_width;
+    int m_height;
+    int m_gridsize;
+    int m_capacity;
 
-                for (int j = 0; j < (int)filter.size(); ++j)
-                {
-                    int xtmp = x + j - margin;
-                    if (xtmp < 0)               xtmp = 0;
-                    else if (width <= xtmp)     xtmp = width - 1;
+    std::vector<Sentry> m_entries;  // m_capacity per cell, row by row
+    std::vector<int>    m_sizes;
+    std::vector<int>    m_added;
+};
 
-                    const int ytmp = y;
+class Cdetector
+{
+public:
+    static void setGaussD(const float sigmaD, std::vector<float>& gaussD);
+    static void setGaussI(const float sigmaI, std::vector<float>& gaussI);
+    virtual ~Cdetector() { }
 
-                    if (!mask.empty() && mask[ytmp][xtmp] == 0) continue;
+protected:
+    // Splits height rows into at most count bands of whole cells of gridsize rows.
+    // Band b owns rows bounds[b] to bounds[b + 1] - 1.
+    static void splitBands(const int height, const int count, const int gridsize, std::vector<int>& bounds);
 
-                    buffer[y][x] += filter[j] * image[ytmp][xtmp];
-                }
-            }
-        }
-        buffer.swap(image);
-    }
+    const SdetectorImage*   m_pimage;
+    int                     m_width;
+    int                     m_height;
 
-    template <class T>
-    void convolveY(std::vector<std::vector<T>>& image, const std::vector<std::vector<unsigned char>>& mask, const std::vector<float>& filter, std::vector<std::vector<T>>& buffer)
+    void setImage(const SdetectorImage& image)
     {
-        const int width = (int)image[0].size();
-        const int height = (int)image.size();
-        const int margin = ((int)filter.size()) / 2;
-    
-        for (int y = 0; y < height; ++y)
-        {
-            for (int x = 0; x < width; ++x)
-            {
-                buffer[y][x] *= 0.0;
-
-                if (!mask.empty() && mask[y][x] == 0) continue;
-
-                for (int j = 0; j < (int)filter.size(); ++j)
-                {
-                    const int xtmp = x;
-                    int ytmp = y + j - margin;
-                    if (ytmp < 0)               ytmp = 0;
-                    else if (height <= ytmp)    ytmp = height - 1;
-
-                    if (!mask.empty() && mask[ytmp][xtmp] == 0) continue;
-
-                    buffer[y][x] += filter[j] * image[ytmp][xtmp];
-                }
-            }
-        }
-        buffer.swap(image);
+        m_pimage = &image;
+        m_width  = image.m_width;
+        m_height = image.m_height;
     }
 
-    template <class T>
-    void convolveX(std::vector<std::vector<T>>& image, const std::vector<float>& filter, std::vector<std::vector<T>>& buffer)
+    int masked(const int index) const { return !m_pimage->m_mask.empty() && m_pimage->m_mask[index] == 0; }
+
+    // Separable convolution of a m_width x m_height image with channels floats per pixel,
+    // restricted to the mask
+    void convolveX(std::vector<float>& image, const int channels, const std::vector<float>& filter, std::vector<float>& buffer) const
     {
-        const int width = image[0].size();
-        const int height = image.size();
-        const int margin = ((int)filter.size()) / 2;
-    
-        for (int y = 0; y < height; ++y)
-        {
-            for (int x = 0; x < width; ++x)
-            {
-                buffer[y][x] *= 0.0;
-
-                for (int j = 0; j < (int)filter.size(); ++j)
-                {
-                    const int xtmp = x + j - margin;
-                    const int ytmp = y;
-                    if (xtmp < 0 || width <= xtmp) continue;
-
-                    buffer[y][x] += filter[j] * image[ytmp][xtmp];
-                }
-            }
-        }
-        buffer.swap(image);
+        Image::Cimage::convolveX(filter, m_width, m_height, channels, m_pimage->m_spans, image, buffer);
     }
 
-    template <class T>
-    void convolveY(std::vector<std::vector<T>>& image, const std::vector<float>& filter, std::vector<std::vector<T>>& buffer)
+    void convolveY(std::vector<float>& image, const int channels, const std::vector<float>& filter, std::vector<float>& buffer) const
     {
-        const int width = image[0].size();
-        const int height = image.size();
-        const int margin = ((int)filter.size()) / 2;
-
-        for (int y = 0; y < height; ++y)
-        {
-            for (int x = 0; x < width; ++x)
-            {
-                buffer[y][x] *= 0.0;
-
-                for (int j = 0; j < (int)filter.size(); ++j)
-                {
-                    const int xtmp = x;
-                    const int ytmp = y + j - margin;
-                    if (ytmp < 0 || height <= ytmp) continue;
-
-                    buffer[y][x] += filter[j] * image[ytmp][xtmp];
-                }
-            }
-        }
-        buffer.swap(image);
+        Image::Cimage::convolveY(filter, m_width, m_height, channels, m_pimage->m_spans, image, buffer);
     }
 };
 
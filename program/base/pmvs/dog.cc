@@ -1,250 +1,299 @@
 #include <algorithm>
+#include <thread>
 
 #include "dog.h"
 #include "point.h"
 
 using namespace PMVS3;
 
-int Cdog::notOnEdge(const std::vector<std::vector<float> >& dog, int x, int y)
+int Cdog::notOnEdge(const std::vector<float>& dog, const int width, int x, int y)
 {
     return 1;
     const float thresholdEdge = 0.06f;
 
-    const float H00   = dog[y][x-1] - 2.0f * dog[y][x] + dog[y][x+1];
-    const float H11   = dog[y-1][x] - 2.0f * dog[y][x] + dog[y+1][x];
-    const float H01   = ((dog[y+1][x+1] - dog[y-1][x+1]) - (dog[y+1][x-1] - dog[y-1][x-1])) / 4.0f;
+    const float* d = &dog[y * width + x];
+    const float H00   = d[-1] - 2.0f * d[0] + d[1];
+    const float H11   = d[-width] - 2.0f * d[0] + d[width];
+    const float H01   = ((d[width+1] - d[-width+1]) - (d[width-1] - d[-width-1])) / 4.0f;
     const float det   = H00 * H11 - H01 * H01;
     const float trace = H00 + H11;
 
     return det > thresholdEdge * trace * trace;
 }
 
-float Cdog::getResponse(const std::vector<std::vector<float>>& pdog, const std::vector<std::vector<float>>& cdog, const std::vector<std::vector<float>>& ndog, const int x, const int y)
+float Cdog::getResponse(const std::vector<float>& pdog, const std::vector<float>& cdog, const std::vector<float>& ndog, const int width, const int x, const int y)
 {
-    return fabs(getResponse(pdog, x, y) + getResponse(cdog, x, y) + getResponse(ndog, x, y) + (cdog[y][x] - pdog[y][x]) + (cdog[y][x] - ndog[y][x]));
+    const int index = y * width + x;
+    return fabs(getResponse(pdog, width, x, y) + getResponse(cdog, width, x, y) + getResponse(ndog, width, x, y) +
+                (cdog[index] - pdog[index]) + (cdog[index] - ndog[index]));
 }
 
-float Cdog::getResponse(const std::vector<std::vector<float>>& dog, const int x, const int y)
+float Cdog::getResponse(const std::vector<float>& dog, const int width, const int x, const int y)
 {
-    const float sum = dog[y-1][x-1] + dog[y  ][x-1] +
-                      dog[y+1][x-1] + dog[y-1][x  ] +
-                      dog[y+1][x  ] + dog[y-1][x+1] +
-                      dog[y  ][x+1] + dog[y+1][x+1];
+    const float* d = &dog[y * width + x];
+    const float sum = d[-width-1] + d[-1] +
+                      d[width-1]  + d[-width] +
+                      d[width]    + d[-width+1] +
+                      d[1]        + d[width+1];
 
-    return 8 * dog[y][x] - sum;
+    return 8 * d[0] - sum;
 }
 
-int Cdog::isLocalMax(const std::vector<std::vector<float>>& dog, const int x, const int y)
+int Cdog::isLocalMax(const std::vector<float>& dog, const int width, const int x, const int y)
 {
-    const float value = dog[y][x];
+    const float* d = &dog[y * width + x];
+    const float value = d[0];
 
     if (0.0 < value)
     {
-        if (dog[y-1][x-1] < value && dog[y  ][x-1] < value && dog[y+1][x-1] < value && dog[y-1][x  ] < value &&
-            dog[y+1][x  ] < value && dog[y-1][x+1] < value && dog[y  ][x+1] < value && dog[y+1][x+1] < value)
+        if (d[-width-1] < value && d[-1] < value && d[width-1] < value && d[-width] < value &&
+            d[width]    < value && d[-width+1] < value && d[1] < value && d[width+1] < value)
         return 1;
     } else
     {
-        if (dog[y-1][x-1] > value && dog[y  ][x-1] > value && dog[y+1][x-1] > value && dog[y-1][x  ] > value &&
-            dog[y+1][x  ] > value && dog[y-1][x+1] > value && dog[y  ][x+1] > value && dog[y+1][x+1] > value)
+        if (d[-width-1] > value && d[-1] > value && d[width-1] > value && d[-width] > value &&
+            d[width]    > value && d[-width+1] > value && d[1] > value && d[width+1] > value)
         return -1;
     }
 
     return 0;
 }
 
-int Cdog::isLocalMax(const std::vector<std::vector<float>>& pdog, const std::vector<std::vector<float>>& cdog, const std::vector<std::vector<float>>& ndog, const int x, const int y)
+int Cdog::isLocalMax(const std::vector<float>& pdog, const std::vector<float>& cdog, const std::vector<float>& ndog, const int width, const int x, const int y)
 {
-    const int flag = isLocalMax(cdog, x, y);
+    const int flag = isLocalMax(cdog, width, x, y);
+    const int index = y * width + x;
 
     if (flag == 1)
     {
-        if (pdog[y][x] < cdog[y][x] && ndog[y][x] < cdog[y][x]) return 1;
-        else                                                    return 0;
+        if (pdog[index] < cdog[index] && ndog[index] < cdog[index]) return 1;
+        else                                                        return 0;
     } else if (flag == -1)
     {
-        if (cdog[y][x] < pdog[y][x] && cdog[y][x] < ndog[y][x]) return -1;
-        else                                                    return 0;
+        if (cdog[index] < pdog[index] && cdog[index] < ndog[index]) return -1;
+        else                                                        return 0;
     }
 
     return 0;
 }
 
-void Cdog::setDOG(const std::vector<std::vector<float>>& cres, const std::vector<std::vector<float>>& nres, std::vector<std::vector<float>>& dog)
+void Cdog::setDOG(const std::vector<float>& cres, const std::vector<float>& nres, std::vector<float>& dog)
 {
-    const int height = (int)cres.size();
-    const int width  = (int)cres[0].size();
-
-    dog = nres;
-    for (int y = 0; y < height; ++y)
-        for (int x = 0; x < width; ++x)
-            dog[y][x] -= cres[y][x];
+    dog.resize(nres.size());
+    for (int i = 0; i < (int)nres.size(); ++i)
+        dog[i] = nres[i] - cres[i];
 }
 
-void Cdog::run(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge,
-               const int width, const int height, const int gspeedup, const float firstScale, const float lastScale, std::multiset<Cpoint> & result)
+void Cdog::run(const SdetectorImage& image, const int gspeedup, const float firstScale, const float lastScale, std::vector<Cpoint>& result,
+               const int bands)
 {
     std::cerr << "DoG running..." << std::flush;
-    m_width  = width;
-    m_height = height;
 
     m_firstScale = firstScale;
     m_lastScale  = lastScale;
 
-    init(image, mask, edge);
-
     const int factor = 2;
     const int maxPointsGrid = factor * factor;
     const int gridsize = gspeedup * factor;
 
-    const int w = (m_width + gridsize - 1)  / gridsize;
-    const int h = (m_height + gridsize - 1) / gridsize;
+    CpointGrid resultgrid;
+    resultgrid.init(image.m_width, image.m_height, gridsize, maxPointsGrid);
+
+    const int octaves = getOctaves(image.m_width, image.m_height);
+    std::vector<int> bounds;
+    splitBands(image.m_height, bands, gridsize, bounds);
+    if ((int)bounds.size() == 2)
+    {
+        detect(image, 0, 0, image.m_height, image.m_height, octaves, resultgrid);
+    } else
+    {
+        // Bands start on rows kept by the subsampling, one more row per octave may be lost at their end
+        const int align = 1 << (octaves - 1);
+        const int halo = getReach(octaves) + (1 << octaves);
+        const int count = (int)bounds.size() - 1;
+        std::vector<SdetectorImage> crops(count);
+        std::vector<Cdog> workers(count);
+        std::vector<std::thread> threads(count);
+        for (int b = 0; b < count; ++b)
+        {
+            const int offset = std::max(0, bounds[b] - halo) / align * align;
+            crops[b].init(image, offset, std::min(image.m_height, bounds[b + 1] + halo));
+            workers[b].m_firstScale = m_firstScale;
+            workers[b].m_lastScale  = m_lastScale;
+            threads[b] = std::thread(&Cdog::detect, &workers[b], std::cref(crops[b]), offset, bounds[b], bounds[b + 1],
+                                     image.m_height, octaves, std::ref(resultgrid));
+        }
+        for (auto& t : threads) t.join();
+    }
+
+    const int count = (int)result.size();
+    resultgrid.collect(1, result);
 
-    std::vector<std::vector<std::multiset<Cpoint>>> resultgrids;
-    resultgrids.resize(h);
-    for (int y = 0; y < h; ++y) resultgrids[y].resize(w);
+    std::cerr << (int)result.size() - count << " dog done" << std::endl;  
+}
 
+int Cdog::getSteps(void) const
+{
     const float scalestep = pow(2.0f, 1 / 2.0f);
-    const int steps = std::max(4, (int)ceil(log(m_lastScale / m_firstScale) / log(scalestep)));
+    return std::max(4, (int)ceil(log(m_lastScale / m_firstScale) / log(scalestep)));
+}
 
-    std::vector<std::vector<float>> pdog, cdog, ndog, cres, nres;
+float Cdog::getSigma(const int k) const
+{
+    const float scalestep = pow(2.0f, 1 / 2.0f);
+    const float sigma0 = m_firstScale * pow(scalestep, k - 1);
+    const float sigma1 = m_firstScale * pow(scalestep, k);
+    return sqrt(sigma1 * sigma1 - sigma0 * sigma0);
+}
 
-    setRes(m_firstScale, cres);
-    setRes(m_firstScale * scalestep, nres);
-    setDOG(cres, nres, cdog);
-    cres.swap(nres);
-    setRes(m_firstScale * scalestep * scalestep, nres);
-    setDOG(cres, nres, ndog);
+int Cdog::getOctaves(int width, int height) const
+{
+    const int steps = getSteps();
+    int octaves = 0;
+    for (int octave = 0; 2 * octave + 1 <= steps - 2; ++octave)
+    {
+        if (octave != 0)
+        {
+            if (std::min(width, height) / 2 < 3) break;
+            width  /= 2;
+            height /= 2;
+        }
+        ++octaves;
+    }
+    return octaves;
+}
 
-    std::vector<std::vector<unsigned char>> alreadydetected;
-    alreadydetected.resize(m_height);
-    for (int y = 0; y < m_height; ++y)
+int Cdog::getReach(const int octaves) const
+{
+    const int steps = getSteps();
+    // Rows of the image behind the first scale of an octave, and behind its extrema
+    int base = (int)ceil(2 * m_firstScale);
+    int reach = 0;
+    for (int octave = 0; octave < octaves; ++octave)
     {
-        alreadydetected[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x) alreadydetected[y][x] = (unsigned char)0;
+        const int levels = std::min(5, steps - 2 * octave + 1);
+        int radius = 0;
+        int next = base;
+        for (int k = 1; k < levels; ++k)
+        {
+            radius += (int)ceil(2 * getSigma(k));
+            if (k == 2) next = base + (radius << octave);
+        }
+        reach = std::max(reach, base + ((radius + 1) << octave));
+        base = next;
     }
+    return reach;
+}
+
+void Cdog::detect(const SdetectorImage& image, const int offset, const int ybegin, const int yend, const int fullHeight,
+                  const int octaves, CpointGrid& resultgrid)
+{
+    setImage(image);
 
-    for (int i = 2; i <= steps - 1; ++i)
+    // Scale n is m_firstScale * scalestep^n, and difference d is between scales d and d + 1
+    const float scalestep = pow(2.0f, 1 / 2.0f);
+    const int steps = getSteps();
+
+    std::vector<unsigned char> alreadydetected(m_width * m_height, (unsigned char)0);
+
+    // Octave o holds scales 2o to 2o + 4 at 1 / 2^o of the resolution, each blurred
+    // from the previous one. Its differences 2o + 1 and 2o + 2 are searched for extrema,
+    // and its scale 2o + 2 is subsampled into the first scale of the next octave.
+    const int channels = m_pimage->m_channels;
+    int width  = m_width;
+    int height = m_height;
+    std::vector<float> blurred = m_pimage->m_image;
+    std::vector<unsigned char> mask = m_pimage->m_mask;
+    std::vector<int> spans = m_pimage->m_spans;
+    std::vector<float> buffer, next;
+    blur(m_firstScale, width, height, spans, blurred, buffer);
+
+    for (int octave = 0; octave < octaves; ++octave)
     {
-        const float cscale = m_firstScale * pow(scalestep, i + 1);
-        cres.swap(nres);
-        setRes(cscale, nres);
+        if (octave != 0)
+        {
+            subsample(width, height, channels, next, blurred);
+            std::vector<unsigned char> vctmp;
+            subsample(width, height, 1, mask, vctmp);
+            mask.swap(vctmp);
+            width  /= 2;
+            height /= 2;
+            Image::Cimage::maskSpans(mask, width, height, spans);
+        }
 
-        pdog.swap(cdog);
-        cdog.swap(ndog);
-        setDOG(cres, nres, ndog);
+        // Scales and differences of the octave, as many as the extrema need
+        const int levels = std::min(5, steps - 2 * octave + 1);
+        std::vector<std::vector<float>> res(levels), dogs(levels - 1);
+        setRes(blurred, res[0]);
+        for (int k = 1; k < levels; ++k)
+        {
+            blur(getSigma(k), width, height, spans, blurred, buffer);
+            setRes(blurred, res[k]);
+            setDOG(res[k - 1], res[k], dogs[k - 1]);
+            if (k == 2) next = blurred;
+        }
 
-        const int margin = (int)ceil(2 * cscale);
-        // Now 3 response maps are ready
-        for (int y = margin; y < m_height - margin; ++y)
+        // Rows of the octave in the whole image
+        const int first = offset >> octave;
+        const int fullRows = fullHeight >> octave;
+        for (int k = 1; k + 1 < levels - 1; ++k)
         {
-            for (int x = margin; x < m_width - margin; ++x)
+            const std::vector<float>& pdog = dogs[k - 1];
+            const std::vector<float>& cdog = dogs[k];
+            const std::vector<float>& ndog = dogs[k + 1];
+
+            const int margin = std::max(1, (int)ceil(2 * m_firstScale * pow(scalestep, k + 2)));
+            // Now 3 response maps are ready
+            for (int y = std::max(margin, first) - first; y < std::min(fullRows - margin, first + height) - first; ++y)
             {
-                if (alreadydetected[y][x])  continue;
-                if (cdog[y][x] == 0.0)      continue;
+                // In the coordinates of the image
+                const int ys = (first + y) << octave;
+                if (ys < ybegin || yend <= ys) continue;
 
-                // Check local maximum
-                if (isLocalMax(pdog, cdog, ndog, x, y) && notOnEdge(cdog, x, y))
+                for (int x = margin; x < width - margin; ++x)
                 {
-                    const int x0 = std::min(x / gridsize, w - 1);
-                    const int y0 = std::min(y / gridsize, h - 1);
+                    const int index = y * width + x;
+                    if (cdog[index] == 0.0)     continue;
 
-                    alreadydetected[y][x] = 1;
-                    Cpoint p;
-                    p.m_icoord = Vec3f((float)x, (float)y, 1.0f);
-                    p.m_response = fabs(cdog[y][x]);
-                    p.m_type = 1;
+                    const int xs = x << octave;
+                    const int detected = (ys - offset) * m_width + xs;
+                    if (alreadydetected[detected]) continue;
 
-                    resultgrids[y0][x0].insert(p);
-
-                    if (maxPointsGrid < (int)resultgrids[y0][x0].size()) resultgrids[y0][x0].erase(resultgrids[y0][x0].begin());
+                    // Check local maximum
+                    if (isLocalMax(pdog, cdog, ndog, width, x, y) && notOnEdge(cdog, width, x, y))
+                    {
+                        alreadydetected[detected] = 1;
+                        resultgrid.add(xs, ys, fabs(cdog[index]), 1);
+                    }
                 }
             }
         }
     }
-
-    for (int y = 0; y < h; ++y)
-    {
-        for (int x = 0; x < w; ++x)
-        {
-            auto begin = resultgrids[y][x].begin();
-            auto end = resultgrids[y][x].end();
-            while (begin != end)
-            {
-                result.insert(*begin);
-                begin++;
-            }
-        }
-    }
-
-    std::cerr << (int)result.size() << " dog done" << std::endl;  
 }
 
-void Cdog::setRes(const float sigma, std::vector<std::vector<float>>& res)
+void Cdog::blur(const float sigma, const int width, const int height, const std::vector<int>& spans,
+                std::vector<float>& image, std::vector<float>& buffer) const
 {
     std::vector<float> gauss;
     setGaussI(sigma, gauss);
 
-    std::vector<std::vector<Vec3f>> vvftmp;
-    vvftmp.resize((int)m_image.size());
-    for (int y = 0; y < (int)m_image.size(); ++y) vvftmp[y].resize((int)m_image[y].size());
-
-    std::vector<std::vector<Vec3f>> restmp = m_image;
-    convolveX(restmp, m_mask, gauss, vvftmp);
-    convolveY(restmp, m_mask, gauss, vvftmp);
-
-    res.resize((int)m_image.size());
-    for (int y = 0; y < (int)m_image.size(); ++y)
-    {
-        res[y].resize((int)m_image[y].size());
-        for (int x = 0; x < (int)m_image[y].size(); ++x) res[y][x] = norm(restmp[y][x]);
-    }
+    Image::Cimage::convolveX(gauss, width, height, m_pimage->m_channels, spans, image, buffer);
+    Image::Cimage::convolveY(gauss, width, height, m_pimage->m_channels, spans, image, buffer);
 }
 
-void Cdog::init(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge)
+void Cdog::setRes(const std::vector<float>& image, std::vector<float>& res) const
 {
-    m_image.clear();
-    m_image.resize(m_height);
-    int count = 0;
-    for (int y = 0; y < m_height; ++y)
+    const int channels = m_pimage->m_channels;
+    const int size = (int)image.size() / channels;
+    res.resize(size);
+    if (channels == 1)
     {
-        m_image[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x)
-        {
-            m_image[y][x][0] = ((int)image[count++]) / 255.0f;
-            m_image[y][x][1] = ((int)image[count++]) / 255.0f;
-            m_image[y][x][2] = ((int)image[count++]) / 255.0f;
-        }
+        for (int i = 0; i < size; ++i) res[i] = fabs(image[i]);
+        return;
     }
-
-    m_mask.clear();
-    if (!mask.empty() || !edge.empty())
+    for (int i = 0; i < size; ++i)
     {
-        m_mask.resize(m_height);
-        count = 0;
-        for (int y = 0; y < m_height; ++y)
-        {
-            m_mask[y].resize(m_width);
-            for (int x = 0; x < m_width; ++x)
-            {
-                if (mask.empty())
-                {
-                    m_mask[y][x] = edge[count++];
-                } else if (edge.empty())
-                {
-                    m_mask[y][x] = mask[count++];
-                } else
-                {
-                    if (mask[count] && edge[count])
-                    {
-                        m_mask[y][x] = (unsigned char)255;
-                    } else
-                    {
-                        m_mask[y][x] = 0;
-                        count++;
-                    }
-                }
-            }
-        }
+        const float* color = &image[3 * i];
+        res[i] = sqrt(color[0] * color[0] + color[1] * color[1] + color[2] * color[2]);
     }
 }
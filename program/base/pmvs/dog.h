@@ -1,6 +1,5 @@
 #pragma once
 
-#include <set>
 #include <vector>
 #include "../numeric/vec3.h"
 #include "detector.h"
@@ -12,11 +11,12 @@ namespace PMVS3
 class Cdog: public Cdetector
 {
 public:
-    void run (const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge,
-              const int width, const int height, const int gspeedup,
+    // Appends the features to result, by increasing response.
+    // With bands, horizontal bands of the image are detected in parallel
+    void run (const SdetectorImage& image, const int gspeedup,
               const float firstScale,   // 1.4f
               const float lastScale,    // 4.0f
-              std::multiset<Cpoint>& result);
+              std::vector<Cpoint>& result, const int bands = 1);
 
     virtual ~Cdog() { }
 
@@ -24,19 +24,49 @@ protected:
     float m_firstScale;
     float m_lastScale;
 
-    void init(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge);
+    int getSteps(void) const;
+    // Sigma blurring scale k - 1 into scale k of an octave, in its pixels
+    float getSigma(const int k) const;
+    int getOctaves(int width, int height) const;
+    // Rows of the image that the extrema of the octaves depend on
+    int getReach(const int octaves) const;
 
-    void setRes(const float sigma, std::vector<std::vector<float>>& res);
+    // Detects rows ybegin to yend - 1 of a fullHeight rows image, whose row offset is row 0 of image
+    void detect(const SdetectorImage& image, const int offset, const int ybegin, const int yend, const int fullHeight,
+                const int octaves, CpointGrid& resultgrid);
 
-    static int isLocalMax(const std::vector<std::vector<float>>& pdog, const std::vector<std::vector<float> >& cdog, const std::vector<std::vector<float>>& ndog, const int x, const int y);
-    static int isLocalMax(const std::vector<std::vector<float>>& dog, const int x, const int y);
+    // Blurs a width x height image with the channels of m_pimage, restricted to spans
+    void blur(const float sigma, const int width, const int height, const std::vector<int>& spans,
+              std::vector<float>& image, std::vector<float>& buffer) const;
 
-    static int notOnEdge(const std::vector<std::vector<float>>& dog, int x, int y);
+    // Norm of the colors of a blurred image, row-major
+    void setRes(const std::vector<float>& image, std::vector<float>& res) const;
 
-    static float getResponse(const std::vector<std::vector<float>>& pdog, const std::vector<std::vector<float>>& cdog, const std::vector<std::vector<float>>& ndog, const int x, const int y);
-    static float getResponse(const std::vector<std::vector<float>>& dog, const int x, const int y);
+    // Every other pixel of a width x height image with channels values per pixel
+    template <class T>
+    static void subsample(const int width, const int height, const int channels, const std::vector<T>& image, std::vector<T>& result)
+    {
+        result.clear();
+        if (image.empty()) return;
 
-    static void setDOG(const std::vector<std::vector<float>>& cres, const std::vector<std::vector<float>>& nres, std::vector<std::vector<float>>& dog);
+        const int w = width / 2;
+        const int h = height / 2;
+        result.resize(w * h * channels);
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+                for (int c = 0; c < channels; ++c)
+                    result[(y * w + x) * channels + c] = image[(2 * y * width + 2 * x) * channels + c];
+    }
+
+    static int isLocalMax(const std::vector<float>& pdog, const std::vector<float>& cdog, const std::vector<float>& ndog, const int width, const int x, const int y);
+    static int isLocalMax(const std::vector<float>& dog, const int width, const int x, const int y);
+
+    static int notOnEdge(const std::vector<float>& dog, const int width, int x, int y);
+
+    static float getResponse(const std::vector<float>& pdog, const std::vector<float>& cdog, const std::vector<float>& ndog, const int width, const int x, const int y);
+    static float getResponse(const std::vector<float>& dog, const int width, const int x, const int y);
+
+    static void setDOG(const std::vector<float>& cres, const std::vector<float>& nres, std::vector<float>& dog);
 };
 
 };
\ No newline at end of file
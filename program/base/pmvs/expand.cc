@@ -45,6 +45,8 @@ void Cexpand::run()
     m_fm.m_pos.collectPatches(m_queue);
 
     std::cerr << "Expanding patches..." << std::flush;
+    m_fm.m_optim.clearCascadeCounts();
+
     std::vector<std::thread> threads(m_fm.m_CPU);
     for (auto& t : threads) t = std::thread(&Cexpand::expandThread, this);
     for (auto& t : threads) t.join();
@@ -65,6 +67,7 @@ void Cexpand::run()
               << 100 * fail0 / (float)trial << ' '
               << 100 * fail1 / (float)trial << ' '
               << 100 * (pass + fail1) / (float)trial << std::endl;
+    m_fm.m_optim.printCascadeCounts();
 }
 
 void Cexpand::expandThread()
@@ -73,6 +76,9 @@ void Cexpand::expandThread()
     const int id = m_fm.m_count++;
     m_fm.m_lock.unlock();
 
+    CoptimContext context;
+    m_fm.m_optim.initContext(context);
+
     while (1)
     {
         Ppatch ppatch;
@@ -96,15 +102,22 @@ void Cexpand::expandThread()
         std::vector<std::vector<Vec4f>> canCoords;
         findEmptyBlocks(ppatch, canCoords);
 
+        // Expansions start from the images of the patch and add neighbors of its reference image
+        m_fm.m_optim.pinImages(ppatch->m_images, context);
+        m_fm.m_optim.pinImages(m_fm.m_visdata2[ppatch->m_images[0]], context);
         for (int i = 0; i < (int)canCoords.size(); ++i)
         {
             for (int j = 0; j < (int)canCoords[i].size(); ++j)
             {
-                const int flag = expandSub(ppatch, id, canCoords[i][j]);
+                const int flag = expandSub(ppatch, id, context, canCoords[i][j]);
                 if (flag) ppatch->m_dflag |= (0x0001) << i;
             }
         }
+        m_fm.m_optim.unpinImages(context);
     }
+
+    std::lock_guard<std::mutex> lock(m_fm.m_lock);
+    m_fm.m_optim.addCascadeCounts(context);
 }
 
 void Cexpand::findEmptyBlocks(const Ppatch& ppatch, std::vector<std::vector<Vec4f>>& canCoords)
@@ -204,7 +217,7 @@ float Cexpand::computeRadius(const Patch::Cpatch& patch)
     return (*(vftmp.begin() + minnum - 1)) * m_fm.m_csize;
 }
 
-int Cexpand::expandSub(const Ppatch& orgppatch, const int id, const Vec4f& canCoord)
+int Cexpand::expandSub(const Ppatch& orgppatch, const int id, CoptimContext& context, const Vec4f& canCoord)
 {
     // Choose the closest one
     Cpatch patch;
@@ -228,15 +241,15 @@ int Cexpand::expandSub(const Ppatch& orgppatch, const int id, const Vec4f& canCo
 
     ++m_ecounts[id];
     // Preprocess
-    if (m_fm.m_optim.preProcess(patch, id, 0))
+    if (m_fm.m_optim.preProcess(patch, context, 0))
     {
         ++m_fcounts0[id];
         return 1;
     }
 
-    m_fm.m_optim.refinePatchBFGS(patch, id);
+    m_fm.m_optim.refinePatchBFGS(patch, context);
 
-    if (m_fm.m_optim.postProcess(patch, id, 0))
+    if (m_fm.m_optim.postProcess(patch, context, 0))
     {
         ++m_fcounts1[id];
         return 1;
@@ -9,6 +9,7 @@ namespace PMVS3
 {
 
 class CfindMatch;
+class CoptimContext;
   
 class Cexpand
 {
@@ -22,7 +23,7 @@ public:
     float computeRadius(const Patch::Cpatch& patch);
 
 protected:
-    int expandSub(const Patch::Ppatch& orgppatch, const int id, const Vec4f& canCoord);
+    int expandSub(const Patch::Ppatch& orgppatch, const int id, CoptimContext& context, const Vec4f& canCoord);
 
     int updateCounts(const Patch::Cpatch& patch);
 
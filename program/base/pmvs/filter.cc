@@ -259,10 +259,19 @@ void Cfilter::filterExact(void)
     }
 
     m_fm.m_debug = 1;
+
+    CoptimContext context;
+    m_fm.m_optim.initContext(context);
   
+    // Images of the previous patch are released once the ones of the next patch are pinned
+    std::vector<int> order;
+    m_fm.m_pos.residentOrder(m_fm.m_pos.m_ppatches, order);
+    std::vector<int> pinned;
+
     int count = 0;
-    for (int p = 0; p < psize; ++p)
+    for (int o = 0; o < psize; ++o)
     {
+        const int p = order[o];
         if (m_fm.m_pos.m_ppatches[p]->m_fix) continue;
     
         Cpatch& patch = *m_fm.m_pos.m_ppatches[p];
@@ -285,7 +294,10 @@ void Cfilter::filterExact(void)
 
         if (m_fm.m_minImageNumThreshold <= (int)patch.m_images.size())
         {
-            m_fm.m_optim.setRefImage(patch, 0);
+            m_fm.m_pss.pin(patch.m_images);
+            m_fm.m_pss.unpin(pinned);
+            pinned = patch.m_images;
+            m_fm.m_optim.setRefImage(patch, context);
             m_fm.m_pos.setGrids(patch);
         }
 
@@ -295,6 +307,7 @@ void Cfilter::filterExact(void)
             count++;
         }
     }
+    m_fm.m_pss.unpin(pinned);
 
     time(&tv); 
     std::cerr << (int)m_fm.m_pos.m_ppatches.size() << " -> "
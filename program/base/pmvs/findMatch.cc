@@ -50,6 +50,14 @@ void CfindMatch::init(const Soption& option)
 
     m_tau = std::min(option.m_minImageNum * 2, m_num);
 
+    // The pyramid holds two levels above m_level, and the cascade window cannot be larger than the main one
+    m_cascade           = std::max(0, std::min(2, option.m_cascade));
+    m_cascadeWsize      = std::max(3, std::min(m_wsize, option.m_cascadeWsize));
+    m_cascadeThreshold  = option.m_cascadeThreshold;
+    m_depthSearch       = option.m_depthSearch;
+    m_fixedPoint        = option.m_fixedPoint;
+    m_minLevel          = std::max(0, std::min(m_level, option.m_minLevel));
+
     // Set target images and other images
     m_bindexes = option.m_bindexes;
     m_visdata  = option.m_visdata;
@@ -59,29 +67,30 @@ void CfindMatch::init(const Soption& option)
     m_countLocks.resize(m_num);
 
     // We set m_level + 3, to use multi-resolutional texture grabbing
-    m_pss.init(m_images, m_prefix, m_level + 3, m_wsize, 1);
+    m_pss.init(m_images, m_prefix, m_level + 3, m_wsize, 1, m_minLevel, m_CPU, option.m_pyramidCache,
+               (long long)option.m_imageBudget << 20, option.m_imageLayout);
 
     if (m_setEdge != 0.0f) m_pss.setEdge(m_setEdge);
     m_pss.setDistances();
 
     // Detect features if not yet done
     CdetectFeatures df;
-    df.run(m_pss, m_num, 16, m_level, m_CPU);  
-
-    // Initialize each core member. m_pos should be first
-    m_pos.init();
-    m_seed.init(df.m_points);
-    m_expand.init();
-    m_filter.init();
-    m_optim.init();
+    df.run(m_pss, m_num, 16, m_level, m_CPU, option.m_grayFeatures, option.m_featureCache);
 
-    // Init thresholds
+    // Init thresholds, before the core members as the seeds select images with them
     m_angleThreshold0 = 60.0f * (float)M_PI / 180.0f;
     m_angleThreshold1 = 60.0f * (float)M_PI / 180.0f;
 
     m_maxAngleThreshold  = option.m_maxAngleThreshold;
     m_nccThresholdBefore = m_nccThreshold - 0.3f;
     m_quadThreshold      = option.m_quadThreshold;
+
+    // Initialize each core member. m_pos should be first
+    m_pos.init();
+    m_seed.init(df.m_points);
+    m_expand.init();
+    m_filter.init();
+    m_optim.init();
 }
 
 int CfindMatch::insideBimages(const Vec4f& coord) const
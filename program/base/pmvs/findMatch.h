@@ -72,6 +72,13 @@ public:
     float m_neighborThreshold2 = 1.0f;          // Parameter for filterNeighbor
     float m_nccThresholdBefore;                 // ncc threshold before optim
     float m_maxAngleThreshold;                  // Maximum angle of images must be at least as large as this
+
+    int   m_cascade;                            // Number of coarse levels checked before refinement
+    int   m_cascadeWsize;                       // Window size of the cascade
+    float m_cascadeThreshold;                   // ncc threshold of the cascade
+    int   m_depthSearch;                        // Search the depth before the full refinement
+    int   m_fixedPoint;                         // Fixed point textures, cleared by Coptim::init if they are not accurate enough
+    int   m_minLevel;                           // Finest pyramid level loaded, textures are never grabbed below it
     float m_visibleThreshold = 0.0f;
     float m_visibleThresholdLoose = 0.0f;
     float m_epThreshold = 2.0f;                 // Maximum angle of images must be at least as large as this
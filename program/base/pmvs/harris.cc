@@ -1,56 +1,11 @@
 #include <algorithm>
+#include <thread>
 #include "harris.h"
 
 using namespace PMVS3;
 
-void Charris::init(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge)
+void Charris::init(void)
 {
-    m_image.clear();
-    m_image.resize(m_height);
-    int count = 0;
-    for (int y = 0; y < m_height; ++y)
-    {
-        m_image[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x)
-        {
-            m_image[y][x][0] = ((int)image[count++]) / 255.0f;
-            m_image[y][x][1] = ((int)image[count++]) / 255.0f;
-            m_image[y][x][2] = ((int)image[count++]) / 255.0f;
-        }
-    }
-
-    m_mask.clear();
-    if (!mask.empty() || !edge.empty())
-    {
-        m_mask.resize(m_height);
-        count = 0;
-        for (int y = 0; y < m_height; ++y)
-        {
-            m_mask[y].resize(m_width);
-            for (int x = 0; x < m_width; ++x)
-            {
-                if (mask.empty())
-                {
-                    m_mask[y][x] = edge[count++];
-                } else if (edge.empty())
-                {
-                    m_mask[y][x] = mask[count++];
-                } else
-                {
-                    if (mask[count] && edge[count])
-                    {
-                        m_mask[y][x] = (unsigned char)255;
-                    }
-                    else
-                    {
-                        m_mask[y][x] = 0;
-                        count++;
-                    }
-                }
-            }
-        }
-    }
-  
     setGaussD(m_sigmaD, m_gaussD);
     setGaussI(m_sigmaI, m_gaussI); 
 }
@@ -66,64 +21,52 @@ void Charris::setDerivatives(void)
 
 void Charris::preprocess2(void)
 {
-    m_dIdxdIdx.clear();  m_dIdydIdy.clear();  m_dIdxdIdy.clear();
-    m_dIdxdIdx.resize(m_height);
-    m_dIdydIdy.resize(m_height);
-    m_dIdxdIdy.resize(m_height);
-    for (int y = 0; y < m_height; ++y)
+    const int size = m_width * m_height;
+    const int channels = m_pimage->m_channels;
+    m_dIdxdIdx.assign(size, 0.0f);
+    m_dIdydIdy.assign(size, 0.0f);
+    m_dIdxdIdy.assign(size, 0.0f);
+    for (int i = 0; i < size; ++i)
     {
-        m_dIdxdIdx[y].resize(m_width);
-        m_dIdydIdy[y].resize(m_width);
-        m_dIdxdIdy[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x)
-        {
-            m_dIdxdIdx[y][x] = m_dIdydIdy[y][x] = m_dIdxdIdy[y][x] = 0.0;
-            if (!m_mask.empty() && m_mask[y][x] == 0)	continue;
+        if (masked(i))	continue;
 
-            m_dIdxdIdx[y][x] += m_dIdx[y][x] * m_dIdx[y][x];
-            m_dIdydIdy[y][x] += m_dIdy[y][x] * m_dIdy[y][x];
-            m_dIdxdIdy[y][x] += m_dIdx[y][x] * m_dIdy[y][x];
+        const float* dx = &m_dIdx[channels * i];
+        const float* dy = &m_dIdy[channels * i];
+        for (int c = 0; c < channels; ++c)
+        {
+            m_dIdxdIdx[i] += dx[c] * dx[c];
+            m_dIdydIdy[i] += dy[c] * dy[c];
+            m_dIdxdIdy[i] += dx[c] * dy[c];
         }
     }
 
     {
-        std::vector<std::vector<Vec3f>>().swap(m_dIdx);
-        std::vector<std::vector<Vec3f>>().swap(m_dIdy);
+        std::vector<float>().swap(m_dIdx);
+        std::vector<float>().swap(m_dIdy);
     }
 
     // Blur
-    std::vector<std::vector<float> > vvftmp;
-    vvftmp.resize(m_height);
-    for (int y = 0; y < m_height; ++y)
-    {
-        vvftmp[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x) vvftmp[y][x] = 0.0;
-    }
+    std::vector<float> vftmp(size);
 
     // m_dIdxdIdx
-    convolveX(m_dIdxdIdx, m_mask, m_gaussI, vvftmp);
-    convolveY(m_dIdxdIdx, m_mask, m_gaussI, vvftmp);
+    convolveX(m_dIdxdIdx, 1, m_gaussI, vftmp);
+    convolveY(m_dIdxdIdx, 1, m_gaussI, vftmp);
 
     // m_dIdydIdy
-    convolveX(m_dIdydIdy, m_mask, m_gaussI, vvftmp);
-    convolveY(m_dIdydIdy, m_mask, m_gaussI, vvftmp);
+    convolveX(m_dIdydIdy, 1, m_gaussI, vftmp);
+    convolveY(m_dIdydIdy, 1, m_gaussI, vftmp);
 
     // m_dIdxdIdy
-    convolveX(m_dIdxdIdy, m_mask, m_gaussI, vvftmp);
-    convolveY(m_dIdxdIdy, m_mask, m_gaussI, vvftmp);
+    convolveX(m_dIdxdIdy, 1, m_gaussI, vftmp);
+    convolveY(m_dIdxdIdy, 1, m_gaussI, vftmp);
 }
 
 void Charris::preprocess(void)
 {
-    std::vector<std::vector<Vec3f> > vvvftmp;
-    vvvftmp.resize(m_height);
-    for (int y = 0; y < m_height; ++y)
-    {
-        vvvftmp[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x) vvvftmp[y][x] = Vec3f();
-    }
+    const int channels = m_pimage->m_channels;
+    std::vector<float> vftmp(m_pimage->m_image.size());
 
-    m_dIdx = m_image;
+    m_dIdx = m_pimage->m_image;
 
     std::vector<float> dfilter, ifilter;
     dfilter.resize(3);
@@ -131,106 +74,108 @@ void Charris::preprocess(void)
     ifilter.resize(3);
     ifilter[0] = 1.0f / 3.0f;  ifilter[1] = 1.0f / 3.0f;  ifilter[2] = 1.0f / 3.0f;
 
-    convolveX(m_dIdx, m_mask, dfilter, vvvftmp);
-    convolveY(m_dIdx, m_mask, ifilter, vvvftmp);
+    convolveX(m_dIdx, channels, dfilter, vftmp);
+    convolveY(m_dIdx, channels, ifilter, vftmp);
 
-    m_dIdy = m_image;
-    convolveX(m_dIdy, m_mask, ifilter, vvvftmp);
-    convolveY(m_dIdy, m_mask, dfilter, vvvftmp);
+    m_dIdy = m_pimage->m_image;
+    convolveX(m_dIdy, channels, ifilter, vftmp);
+    convolveY(m_dIdy, channels, dfilter, vftmp);
 }
 
 void Charris::setResponse(void)
 {
-    m_response.clear();
-    m_response.resize(m_height);
-    for (int y = 0; y < m_height; ++y)
+    const int size = m_width * m_height;
+    m_response.assign(size, 0.0f);
+    for (int i = 0; i < size; ++i)
     {
-        m_response[y].resize(m_width);
-        for (int x = 0; x < m_width; ++x)
-        {
-            m_response[y][x] = 0.0;
-            if (!m_mask.empty() && m_mask[y][x] == 0)	continue;
+        if (masked(i))	continue;
 
-            const float D = m_dIdxdIdx[y][x] * m_dIdydIdy[y][x] - m_dIdxdIdy[y][x] * m_dIdxdIdy[y][x];
-            const float tr = m_dIdxdIdx[y][x] + m_dIdydIdy[y][x];
-            m_response[y][x] = D - 0.06 * tr * tr;
-        }
+        const float D = m_dIdxdIdx[i] * m_dIdydIdy[i] - m_dIdxdIdy[i] * m_dIdxdIdy[i];
+        const float tr = m_dIdxdIdx[i] + m_dIdydIdy[i];
+        m_response[i] = D - 0.06 * tr * tr;
+    }
+
+    {
+        std::vector<float>().swap(m_dIdxdIdx);
+        std::vector<float>().swap(m_dIdydIdy);
+        std::vector<float>().swap(m_dIdxdIdy);
     }
 
     // Suppress non local max
-    std::vector<std::vector<float> > vvftmp = m_response;
+    std::vector<float> vftmp = m_response;
     for (int y = 1; y < m_height - 1; ++y)
     {
+        const float* response = &m_response[y * m_width];
         for (int x = 1; x < m_width - 1; ++x)
         {
-            if (m_response[y][x] < m_response[y][x+1] || m_response[y][x] < m_response[y][x-1] ||
-                m_response[y][x] < m_response[y+1][x] || m_response[y][x] < m_response[y-1][x])
-                vvftmp[y][x] = 0.0;
+            if (response[x] < response[x+1] || response[x] < response[x-1] ||
+                response[x] < response[x+m_width] || response[x] < response[x-m_width])
+                vftmp[y * m_width + x] = 0.0;
         }
     }
 
-    vvftmp.swap(m_response);
+    vftmp.swap(m_response);
 }
 
-void Charris::run(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge,
-                const int width, const int height, const int gspeedup, const float sigma, std::multiset<Cpoint> & result)
+void Charris::run(const SdetectorImage& image, const int gspeedup, const float sigma, std::vector<Cpoint>& result, const int bands)
 {
     std::cerr << "Harris running ..." << std::flush;
-    m_width  = width;
-    m_height = height;
-    m_sigmaD = sigma;
-    m_sigmaI = sigma;
-    init(image, mask, edge);
-    setDerivatives();
-    setResponse();
 
     const int factor = 2;
     const int maxPointsGrid = factor * factor;
     const int gridsize = gspeedup * factor;
 
-    const int w = (m_width + gridsize - 1)  / gridsize;
-    const int h = (m_height + gridsize - 1) / gridsize;
-  
-    std::vector<std::vector<std::multiset<Cpoint>>> resultgrids;
-    resultgrids.resize(h);
-    for (int y = 0; y < h; ++y) resultgrids[y].resize(w);
+    CpointGrid resultgrid;
+    resultgrid.init(image.m_width, image.m_height, gridsize, maxPointsGrid);
 
-    const int margin = (int)m_gaussD.size() / 2;
-    for (int y = margin; y < m_height - margin; ++y)
+    std::vector<int> bounds;
+    splitBands(image.m_height, bands, gridsize, bounds);
+    if ((int)bounds.size() == 2)
     {
-        for (int x = margin; x < m_width - margin; ++x)
+        detect(image, 0, 0, image.m_height, image.m_height, sigma, resultgrid);
+    } else
+    {
+        // Rows reached by the derivatives, the blur and the suppression
+        const int halo = (int)ceil(2 * sigma) + 2;
+        const int count = (int)bounds.size() - 1;
+        std::vector<SdetectorImage> crops(count);
+        std::vector<Charris> workers(count);
+        std::vector<std::thread> threads(count);
+        for (int b = 0; b < count; ++b)
         {
-            if (m_response[y][x] == 0.0) continue;
+            const int offset = std::max(0, bounds[b] - halo);
+            crops[b].init(image, offset, std::min(image.m_height, bounds[b + 1] + halo));
+            threads[b] = std::thread(&Charris::detect, &workers[b], std::cref(crops[b]), offset, bounds[b], bounds[b + 1],
+                                     image.m_height, sigma, std::ref(resultgrid));
+        }
+        for (auto& t : threads) t.join();
+    }
 
-            const int x0 = std::min(x / gridsize, w - 1);
-            const int y0 = std::min(y / gridsize, h - 1);
+    const int count = (int)result.size();
+    resultgrid.collect(0, result);
 
-            if ((int)resultgrids[y0][x0].size() < maxPointsGrid || resultgrids[y0][x0].begin()->m_response < m_response[y][x])
-            {
-                Cpoint p;
-                p.m_icoord = Vec3f((float)x, (float)y, 1.0f);
-                p.m_response = m_response[y][x];
-                p.m_type = 0;
+    std::cerr << (int)result.size() - count << " harris done" << std::endl;
+}
 
-                resultgrids[y0][x0].insert(p);
-                if (maxPointsGrid < (int)resultgrids[y0][x0].size()) resultgrids[y0][x0].erase(resultgrids[y0][x0].begin ());
-            }
-        }
-    }
+void Charris::detect(const SdetectorImage& image, const int offset, const int ybegin, const int yend, const int height,
+                     const float sigma, CpointGrid& resultgrid)
+{
+    setImage(image);
+    m_sigmaD = sigma;
+    m_sigmaI = sigma;
+    init();
+    setDerivatives();
+    setResponse();
 
-    for (int y = 0; y < h; ++y)
+    const int margin = (int)m_gaussD.size() / 2;
+    for (int y = std::max(margin, ybegin); y < std::min(height - margin, yend); ++y)
     {
-        for (int x = 0; x < w; ++x)
+        for (int x = margin; x < m_width - margin; ++x)
         {
-            auto begin = resultgrids[y][x].begin();
-            auto end = resultgrids[y][x].end();
-            while (begin != end)
-            {
-                result.insert(*begin);
-                begin++;
-            }
+            const float response = m_response[(y - offset) * m_width + x];
+            if (response == 0.0) continue;
+
+            resultgrid.add(x, y, response, 0);
         }
     }
-
-    std::cerr << (int)result.size() << " harris done" << std::endl;
 }
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <vector>
-#include <set>
 
 #include "../numeric/vec3.h"
 #include "detector.h"
@@ -13,8 +12,9 @@ namespace PMVS3
 class Charris: public Cdetector
 {
 public:
-    void run(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge,
-             const int width, const int height, const int gspeedup, const float sigma, std::multiset<Cpoint> & result);
+    // Appends the features to result, by increasing response.
+    // With bands, horizontal bands of the image are detected in parallel
+    void run(const SdetectorImage& image, const int gspeedup, const float sigma, std::vector<Cpoint>& result, const int bands = 1);
 
     virtual ~Charris() { }
 
@@ -25,16 +25,22 @@ protected:
     std::vector<float> m_gaussD;
     std::vector<float> m_gaussI;
 
-    std::vector<std::vector<Vec3f>> m_dIdx;
-    std::vector<std::vector<Vec3f>> m_dIdy;
+    // Row-major, as many floats per pixel as the image
+    std::vector<float> m_dIdx;
+    std::vector<float> m_dIdy;
 
-    std::vector<std::vector<float>> m_dIdxdIdx;
-    std::vector<std::vector<float>> m_dIdydIdy;
-    std::vector<std::vector<float>> m_dIdxdIdy;
+    // Row-major, a float per pixel
+    std::vector<float> m_dIdxdIdx;
+    std::vector<float> m_dIdydIdy;
+    std::vector<float> m_dIdxdIdy;
 
-    std::vector<std::vector<float>> m_response;
+    std::vector<float> m_response;
 
-    void init(const std::vector<unsigned char>& image, const std::vector<unsigned char>& mask, const std::vector<unsigned char>& edge);
+    void init(void);
+
+    // Detects rows ybegin to yend - 1 of a height rows image, whose row offset is row 0 of image
+    void detect(const SdetectorImage& image, const int offset, const int ybegin, const int yend, const int height,
+                const float sigma, CpointGrid& resultgrid);
 
     void setDerivatives(void);
     void preprocess(void);
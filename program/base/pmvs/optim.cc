@@ -7,6 +7,15 @@
 #include "findMatch.h"
 #include "optim.h"
 #include <cstdio>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && 2 <= _M_IX86_FP)
+#define PMVS_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 using namespace Patch;
 using namespace PMVS3;
@@ -14,93 +23,662 @@ using namespace PMVS3;
 namespace
 {
 
-    // The base class for functors when using the (unsupported) NonLinearOptimization module
-    template<typename _Scalar, int NX = Eigen::Dynamic, int NY = Eigen::Dynamic>
-    struct LMFunctor
+    // Derivative of the image projection of coord when coord moves along dcoord (a direction, w = 0)
+    Vec2f projectD(const std::vector<Vec4f>& projection, const Vec4f& coord, const Vec4f& dcoord)
     {
-        typedef _Scalar Scalar;
+        const float w  = projection[2] * coord;
+        const float dw = projection[2] * dcoord;
+        const float u  = projection[0] * coord / w;
+        const float v  = projection[1] * coord / w;
 
-        enum
+        return Vec2f((projection[0] * dcoord - u * dw) / w, (projection[1] * dcoord - v * dw) / w);
+    }
+
+    // Pixels at (x, y), (x + 1, y), (x, y + 1) and (x + 1, y + 1) of a view
+    inline void corners(const Image::SimageView& view, const int x, const int y, const unsigned char** const pixels)
+    {
+        if (view.m_tiles == 0)
         {
-            InputsAtCompileTime = NX,
-            ValuesAtCompileTime = NY
-        };
+            pixels[0] = view.m_pixels + view.offset(x, y);
+            pixels[1] = pixels[0] + 3;
+            pixels[2] = pixels[0] + 3 * view.m_width;
+            pixels[3] = pixels[2] + 3;
+            return;
+        }
+        pixels[0] = view.m_pixels + view.offset(x, y);
+        pixels[1] = view.m_pixels + view.offset(x + 1, y);
+        pixels[2] = view.m_pixels + view.offset(x, y + 1);
+        pixels[3] = view.m_pixels + view.offset(x + 1, y + 1);
+    }
 
-        typedef Eigen::Matrix<Scalar, InputsAtCompileTime, 1> InputType;
-        typedef Eigen::Matrix<Scalar, ValuesAtCompileTime, 1> ValueType;
-        typedef Eigen::Matrix<Scalar, ValuesAtCompileTime, InputsAtCompileTime> JacobianType;
+    // Bilinear color at (x, y) of a view, accumulated into the sums about pivot
+    inline void sampleColor(const Image::SimageView& view, const float x, const float y,
+                            const float* const pivot, float* const rgb, float* const sum, float* const sum2)
+    {
+        const int lx = (int)floor(x);
+        const int ly = (int)floor(y);
+        const float dx1 = x - lx;  const float dx0 = 1.0f - dx1;
+        const float dy1 = y - ly;  const float dy0 = 1.0f - dy1;
+
+        const unsigned char* pixels[4];
+        corners(view, lx, ly, pixels);
+
+#ifdef PMVS_SSE2
+        // One lane per channel. The fourth lane reads the next byte and is ignored.
+        int i00, i10, i01, i11;
+        memcpy(&i00, pixels[0], 4);  memcpy(&i10, pixels[1], 4);
+        memcpy(&i01, pixels[2], 4);  memcpy(&i11, pixels[3], 4);
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 c00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(i00), zero), zero));
+        const __m128 c10 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(i10), zero), zero));
+        const __m128 c01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(i01), zero), zero));
+        const __m128 c11 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(i11), zero), zero));
+
+        const __m128 color = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c00, _mm_set1_ps(dx0 * dy0)), _mm_mul_ps(c01, _mm_set1_ps(dx0 * dy1))),
+                                        _mm_add_ps(_mm_mul_ps(c10, _mm_set1_ps(dx1 * dy0)), _mm_mul_ps(c11, _mm_set1_ps(dx1 * dy1))));
+        const __m128 diff  = _mm_sub_ps(color, _mm_loadu_ps(pivot));
+
+        float out[4];
+        _mm_storeu_ps(out, color);
+        rgb[0] = out[0];  rgb[1] = out[1];  rgb[2] = out[2];
+        _mm_storeu_ps(sum,  _mm_add_ps(_mm_loadu_ps(sum),  diff));
+        _mm_storeu_ps(sum2, _mm_add_ps(_mm_loadu_ps(sum2), _mm_mul_ps(diff, diff)));
+#else
+        const float f00 = dx0 * dy0;  const float f01 = dx0 * dy1;
+        const float f10 = dx1 * dy0;  const float f11 = dx1 * dy1;
+        for (int c = 0; c < 3; ++c)
+        {
+            rgb[c] = pixels[0][c] * f00 + pixels[2][c] * f01 + pixels[1][c] * f10 + pixels[3][c] * f11;
+            const float diff = rgb[c] - pivot[c];
+            sum[c]  += diff;
+            sum2[c] += diff * diff;
+        }
+#endif
+    }
 
-        const int m_inputs, m_values;
+#ifdef __AVX2__
+    inline __m256 channel(const __m256i colors, const int c)
+    {
+        return _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srlv_epi32(colors, _mm256_set1_epi32(8 * c)), _mm256_set1_epi32(0xff)));
+    }
 
-        LMFunctor()
-            : m_inputs(InputsAtCompileTime)
-            , m_values(ValuesAtCompileTime)
-        {}
+    inline float hsum(const __m256 v)
+    {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
 
-        LMFunctor(int inputs, int values)
-            : m_inputs(inputs)
-            , m_values(values)
-        {}
+    // Byte offsets of the pixels at (x, y), (x + 1, y), (x, y + 1) and (x + 1, y + 1) of a view for eight samples,
+    // given the floors of their coordinates
+    inline void cornerOffsets(const Image::SimageView& view, const __m256 fx, const __m256 fy, __m256i* const offsets)
+    {
+        const __m256i x = _mm256_cvtps_epi32(fx);
+        const __m256i y = _mm256_cvtps_epi32(fy);
+        const __m256i three = _mm256_set1_epi32(3);
+        if (view.m_tiles == 0)
+        {
+            offsets[0] = _mm256_mullo_epi32(three, _mm256_add_epi32(_mm256_mullo_epi32(y, _mm256_set1_epi32(view.m_width)), x));
+            offsets[1] = _mm256_add_epi32(offsets[0], three);
+            offsets[2] = _mm256_add_epi32(offsets[0], _mm256_set1_epi32(3 * view.m_width));
+            offsets[3] = _mm256_add_epi32(offsets[2], three);
+            return;
+        }
 
-        int inputs() const { return m_inputs; }
-        int values() const { return m_values; }
+        // Offsets of the two rows and the two columns, as in SimageView::offset
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i rows = _mm256_set1_epi32(64 * view.m_tiles);
+        const __m256i x1 = _mm256_add_epi32(x, one);
+        const __m256i y1 = _mm256_add_epi32(y, one);
+        const __m256i row0 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(y, 2), rows), _mm256_slli_epi32(_mm256_and_si256(y, three), 4));
+        const __m256i row1 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(y1, 2), rows), _mm256_slli_epi32(_mm256_and_si256(y1, three), 4));
+        const __m256i col0 = _mm256_add_epi32(_mm256_slli_epi32(_mm256_srai_epi32(x, 2), 6), _mm256_slli_epi32(_mm256_and_si256(x, three), 2));
+        const __m256i col1 = _mm256_add_epi32(_mm256_slli_epi32(_mm256_srai_epi32(x1, 2), 6), _mm256_slli_epi32(_mm256_and_si256(x1, three), 2));
+        offsets[0] = _mm256_add_epi32(row0, col0);
+        offsets[1] = _mm256_add_epi32(row0, col1);
+        offsets[2] = _mm256_add_epi32(row1, col0);
+        offsets[3] = _mm256_add_epi32(row1, col1);
+    }
 
-        // You should define that in the subclass:
-        // int operator() (const InputType& x, ValueType* v, JacobianType* _j=0) const;
-    };
+    // Moves the grid positions (gx, gy) of eight samples to the next rows when gx runs past the window
+    inline void wrapGrid(__m256& gx, __m256& gy, const __m256 sizef)
+    {
+        for (;;)
+        {
+            const __m256 wrap = _mm256_cmp_ps(gx, sizef, _CMP_GE_OQ);
+            if (_mm256_movemask_ps(wrap) == 0) break;
+            gx = _mm256_sub_ps(gx, _mm256_and_ps(wrap, sizef));
+            gy = _mm256_add_ps(gy, _mm256_and_ps(wrap, _mm256_set1_ps(1.0f)));
+        }
+    }
+#endif
 
-    template<typename Scalar>
-    struct LMRefinePatch : LMFunctor<Scalar>
+    // Samples a size x size grid of colors (row by row, starting at left and stepping by dx and dy) into an
+    // interleaved rgb texture. Sums are taken about the first pixel so that the variance does not cancel out.
+    // W is the window size when known at compile time, 0 otherwise.
+    template<int W>
+    void sampleTex(const Image::SimageView& view, const Vec3f& left, const Vec3f& dx, const Vec3f& dy,
+                   const int wsize, float* const tex, Vec3f& ave, float& scale)
     {
-        explicit LMRefinePatch(int id)
-            : LMFunctor<Scalar>(3, 3)
-            , m_id(id)
-        {}
+        const int size = W ? W : wsize;
+        const int num  = size * size;
+
+        const unsigned char* ucp = view.m_pixels + view.offset((int)floor(left[0]), (int)floor(left[1]));
+        const float pivot[4] = {(float)ucp[0], (float)ucp[1], (float)ucp[2], 0.0f};
+        float sum[4]  = {0.0f, 0.0f, 0.0f, 0.0f};
+        float sum2[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+        int k = 0;
+#ifdef __AVX2__
+        // Eight samples at a time, with their grid positions carried over from one block to the next
+        __m256 gx = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256 gy = _mm256_setzero_ps();
+        const __m256 sizef = _mm256_set1_ps((float)size);
+        const __m256 one   = _mm256_set1_ps(1.0f);
+        const __m256 eight = _mm256_set1_ps(8.0f);
+        wrapGrid(gx, gy, sizef);
+
+        const __m256 lr[3] = {_mm256_set1_ps(pivot[0]), _mm256_set1_ps(pivot[1]), _mm256_set1_ps(pivot[2])};
+        __m256 vsum[3]  = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+        __m256 vsum2[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+        for (; k + 8 <= num; k += 8)
+        {
+            const __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(left[0]), _mm256_mul_ps(gx, _mm256_set1_ps(dx[0]))), _mm256_mul_ps(gy, _mm256_set1_ps(dy[0])));
+            const __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(left[1]), _mm256_mul_ps(gx, _mm256_set1_ps(dx[1]))), _mm256_mul_ps(gy, _mm256_set1_ps(dy[1])));
+
+            const __m256 fx = _mm256_floor_ps(x);
+            const __m256 fy = _mm256_floor_ps(y);
+            const __m256 dx1 = _mm256_sub_ps(x, fx);  const __m256 dx0 = _mm256_sub_ps(one, dx1);
+            const __m256 dy1 = _mm256_sub_ps(y, fy);  const __m256 dy0 = _mm256_sub_ps(one, dy1);
+
+            __m256i offsets[4];
+            cornerOffsets(view, fx, fy, offsets);
+            const __m256i c00 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[0], 1);
+            const __m256i c10 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[1], 1);
+            const __m256i c01 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[2], 1);
+            const __m256i c11 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[3], 1);
+
+            const __m256 f00 = _mm256_mul_ps(dx0, dy0);  const __m256 f01 = _mm256_mul_ps(dx0, dy1);
+            const __m256 f10 = _mm256_mul_ps(dx1, dy0);  const __m256 f11 = _mm256_mul_ps(dx1, dy1);
+
+            float out[3][8];
+            for (int c = 0; c < 3; ++c)
+            {
+                const __m256 color = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(channel(c00, c), f00), _mm256_mul_ps(channel(c01, c), f01)),
+                                                   _mm256_add_ps(_mm256_mul_ps(channel(c10, c), f10), _mm256_mul_ps(channel(c11, c), f11)));
+                const __m256 diff = _mm256_sub_ps(color, lr[c]);
+                vsum[c]  = _mm256_add_ps(vsum[c], diff);
+                vsum2[c] = _mm256_add_ps(vsum2[c], _mm256_mul_ps(diff, diff));
+                _mm256_storeu_ps(out[c], color);
+            }
+
+            float* texp = tex + 3 * k;
+            for (int j = 0; j < 8; ++j)
+            {
+                *(texp++) = out[0][j];
+                *(texp++) = out[1][j];
+                *(texp++) = out[2][j];
+            }
+
+            gx = _mm256_add_ps(gx, eight);
+            wrapGrid(gx, gy, sizef);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            sum[c]  = hsum(vsum[c]);
+            sum2[c] = hsum(vsum2[c]);
+        }
+#endif
 
-        int operator()(const Eigen::Matrix<Scalar, Eigen::Dynamic, 1, 0>& x, Eigen::Matrix<Scalar, Eigen::Dynamic, 1, 0>& fvec) const
+        for (; k < num; ++k)
         {
-            Coptim::my_f_lm(x, fvec, m_id);
+            const int x = k % size;
+            const int y = k / size;
+            const Vec3f pos = left + dx * (float)x + dy * (float)y;
+            sampleColor(view, pos[0], pos[1], pivot, tex + 3 * k, sum, sum2);
+        }
 
-            return 0;
+        float var = 0.0f;
+        for (int c = 0; c < 3; ++c)
+        {
+            const float mean = sum[c] / num;
+            ave[c] = pivot[c] + mean;
+            var += sum2[c] - sum[c] * mean;
         }
 
-        int m_id;
-    };
+        scale = sqrt(std::max(0.0f, var) / (3 * num));
+        if (scale == 0.0f) scale = 1.0f;
+    }
 
-}
+    // Same grid as sampleTex, also returning the derivatives of every color w.r.t. the three patch parameters in dtex
+    // (three floats per color). The grid moves with the parameters as dcenter + ddx * x + ddy * y about its center.
+    template<int W>
+    void sampleTexD(const Image::SimageView& view, const Vec3f& left, const Vec3f& dx, const Vec3f& dy, const int wsize,
+                    const Vec2f* const dcenter, const Vec2f* const ddx, const Vec2f* const ddy, float* const tex, float* const dtex)
+    {
+        const int size   = W ? W : wsize;
+        const int num    = size * size;
+        const int margin = size / 2;
+
+        int k = 0;
+#ifdef __AVX2__
+        // Eight samples at a time, the colors and their 3 x 3 derivatives are computed one per lane
+        __m256 gx = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256 gy = _mm256_setzero_ps();
+        const __m256 sizef = _mm256_set1_ps((float)size);
+        const __m256 one   = _mm256_set1_ps(1.0f);
+        const __m256 eight = _mm256_set1_ps(8.0f);
+        const __m256 marginf = _mm256_set1_ps((float)margin);
+        wrapGrid(gx, gy, sizef);
+
+        for (; k + 8 <= num; k += 8)
+        {
+            const __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(left[0]), _mm256_mul_ps(gx, _mm256_set1_ps(dx[0]))), _mm256_mul_ps(gy, _mm256_set1_ps(dy[0])));
+            const __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(left[1]), _mm256_mul_ps(gx, _mm256_set1_ps(dx[1]))), _mm256_mul_ps(gy, _mm256_set1_ps(dy[1])));
+
+            const __m256 fx = _mm256_floor_ps(x);
+            const __m256 fy = _mm256_floor_ps(y);
+            const __m256 dx1 = _mm256_sub_ps(x, fx);  const __m256 dx0 = _mm256_sub_ps(one, dx1);
+            const __m256 dy1 = _mm256_sub_ps(y, fy);  const __m256 dy0 = _mm256_sub_ps(one, dy1);
+
+            __m256i offsets[4];
+            cornerOffsets(view, fx, fy, offsets);
+            const __m256i c00 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[0], 1);
+            const __m256i c10 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[1], 1);
+            const __m256i c01 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[2], 1);
+            const __m256i c11 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[3], 1);
+
+            // Motion of the samples w.r.t. each parameter
+            const __m256 ox = _mm256_sub_ps(gx, marginf);
+            const __m256 oy = _mm256_sub_ps(gy, marginf);
+            __m256 du[3], dv[3];
+            for (int p = 0; p < 3; ++p)
+            {
+                du[p] = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(dcenter[p][0]), _mm256_mul_ps(ox, _mm256_set1_ps(ddx[p][0]))), _mm256_mul_ps(oy, _mm256_set1_ps(ddy[p][0])));
+                dv[p] = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(dcenter[p][1]), _mm256_mul_ps(ox, _mm256_set1_ps(ddx[p][1]))), _mm256_mul_ps(oy, _mm256_set1_ps(ddy[p][1])));
+            }
+
+            float out[3][8], dout[9][8];
+            for (int c = 0; c < 3; ++c)
+            {
+                const __m256 f00 = channel(c00, c);  const __m256 f10 = channel(c10, c);
+                const __m256 f01 = channel(c01, c);  const __m256 f11 = channel(c11, c);
+
+                const __m256 top    = _mm256_add_ps(_mm256_mul_ps(f00, dx0), _mm256_mul_ps(f10, dx1));
+                const __m256 bottom = _mm256_add_ps(_mm256_mul_ps(f01, dx0), _mm256_mul_ps(f11, dx1));
+                _mm256_storeu_ps(out[c], _mm256_add_ps(_mm256_mul_ps(top, dy0), _mm256_mul_ps(bottom, dy1)));
+
+                const __m256 dcdx = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(f10, f00), dy0), _mm256_mul_ps(_mm256_sub_ps(f11, f01), dy1));
+                const __m256 dcdy = _mm256_sub_ps(bottom, top);
+                for (int p = 0; p < 3; ++p)
+                    _mm256_storeu_ps(dout[3 * c + p], _mm256_add_ps(_mm256_mul_ps(du[p], dcdx), _mm256_mul_ps(dv[p], dcdy)));
+            }
+
+            float* texp  = tex + 3 * k;
+            float* dtexp = dtex + 9 * k;
+            for (int j = 0; j < 8; ++j)
+            {
+                for (int c = 0; c < 3; ++c) *(texp++) = out[c][j];
+                for (int i = 0; i < 9; ++i) *(dtexp++) = dout[i][j];
+            }
+
+            gx = _mm256_add_ps(gx, eight);
+            wrapGrid(gx, gy, sizef);
+        }
+#endif
+
+        for (; k < num; ++k)
+        {
+            const int gx = k % size;
+            const int gy = k / size;
+            const Vec3f pos = left + dx * (float)gx + dy * (float)gy;
+
+            const int lx = (int)floor(pos[0]);
+            const int ly = (int)floor(pos[1]);
+            const float dx1 = pos[0] - lx;  const float dx0 = 1.0f - dx1;
+            const float dy1 = pos[1] - ly;  const float dy0 = 1.0f - dy1;
+
+            const unsigned char* pixels[4];
+            corners(view, lx, ly, pixels);
+
+            float du[3], dv[3];
+            for (int p = 0; p < 3; ++p)
+            {
+                const Vec2f dsample = dcenter[p] + ddx[p] * (float)(gx - margin) + ddy[p] * (float)(gy - margin);
+                du[p] = dsample[0];
+                dv[p] = dsample[1];
+            }
+
+            float* texp  = tex + 3 * k;
+            float* dtexp = dtex + 9 * k;
+            for (int c = 0; c < 3; ++c)
+            {
+                const float top    = pixels[0][c] * dx0 + pixels[1][c] * dx1;
+                const float bottom = pixels[2][c] * dx0 + pixels[3][c] * dx1;
+                const float dcdx   = (pixels[1][c] - pixels[0][c]) * dy0 + (pixels[3][c] - pixels[2][c]) * dy1;
+                const float dcdy   = bottom - top;
+
+                *(texp++) = top * dy0 + bottom * dy1;
+                for (int p = 0; p < 3; ++p) *(dtexp++) = du[p] * dcdx + dv[p] * dcdy;
+            }
+        }
+    }
+
+    // Normalized dot product of two raw textures of size floats given their mean colors and scales
+    template<int W>
+    float computeZNCC(const float* const t0, const Vec3f& ave0, const float scale0,
+                      const float* const t1, const Vec3f& ave1, const float scale1, const int tsize)
+    {
+        const int size = W ? 3 * W * W : tsize;
+
+        // Means repeated with the rgb period, enough for three vectors
+        float a0[24], a1[24];
+        for (int j = 0; j < 24; ++j)
+        {
+            a0[j] = ave0[j % 3];
+            a1[j] = ave1[j % 3];
+        }
+
+        float ans = 0.0f;
+        int i = 0;
+#if defined(__AVX2__)
+        __m256 acc = _mm256_setzero_ps();
+        for (; i + 24 <= size; i += 24)
+        {
+            for (int j = 0; j < 24; j += 8)
+            {
+                const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(t0 + i + j), _mm256_loadu_ps(a0 + j));
+                const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(t1 + i + j), _mm256_loadu_ps(a1 + j));
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(d0, d1));
+            }
+        }
+        ans = hsum(acc);
+#elif defined(PMVS_SSE2)
+        __m128 acc = _mm_setzero_ps();
+        for (; i + 12 <= size; i += 12)
+        {
+            for (int j = 0; j < 12; j += 4)
+            {
+                const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(t0 + i + j), _mm_loadu_ps(a0 + j));
+                const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(t1 + i + j), _mm_loadu_ps(a1 + j));
+                acc = _mm_add_ps(acc, _mm_mul_ps(d0, d1));
+            }
+        }
+        float out[4];
+        _mm_storeu_ps(out, acc);
+        ans = (out[0] + out[1]) + (out[2] + out[3]);
+#endif
+        for (; i < size; ++i) ans += (t0[i] - a0[i % 3]) * (t1[i] - a1[i % 3]);
+
+        return ans / (size * scale0 * scale1);
+    }
+
+    // Removes the mean color and divides by the returned scale, size3 is the number of rgb samples
+    float normalizeTex(float* const tex, const int size3)
+    {
+        Vec3f ave;
+        const float* texp = tex;
+        for (int i = 0; i < size3; ++i, texp += 3)
+        {
+            ave[0] += texp[0];
+            ave[1] += texp[1];
+            ave[2] += texp[2];
+        }
+
+        ave /= (float)size3;
+
+        float ave2 = 0.0;
+        texp = tex;
+        for (int i = 0; i < size3; ++i, texp += 3)
+        {
+            const float f0 = ave[0] - texp[0];
+            const float f1 = ave[1] - texp[1];
+            const float f2 = ave[2] - texp[2];
+
+            ave2 += f0 * f0 + f1 * f1 + f2 * f2;
+        }
+
+        ave2 = sqrt(ave2 / (3 * size3));
 
-Coptim* Coptim::m_one = nullptr;
+        if (ave2 == 0.0f) ave2 = 1.0f;
+
+        float* tp = tex;
+        for (int i = 0; i < size3; ++i, tp += 3)
+        {
+            tp[0] = (tp[0] - ave[0]) / ave2;
+            tp[1] = (tp[1] - ave[1]) / ave2;
+            tp[2] = (tp[2] - ave[2]) / ave2;
+        }
+
+        return ave2;
+    }
+
+    // Fixed point textures hold colors with FixedBits fractional bits. Bilinear weights have 8 bits.
+    const int FixedBits = 4;
+
+    // Fixed point counterpart of sampleTex, into three planes of stride samples. Also returns the sum of each plane.
+    void sampleTexFixed(const Image::SimageView& view, const Vec3f& left, const Vec3f& dx, const Vec3f& dy,
+                        const int size, const int stride, short* const tex, int* const sums)
+    {
+        const int num = size * size;
+        const int shift = 16 - FixedBits;
+        sums[0] = sums[1] = sums[2] = 0;
+
+        int k = 0;
+#ifdef __AVX2__
+        // Eight samples at a time. In a row, the colors of a channel at the two pixels are paired in the 16 bit halves
+        // of a lane and weighted in one madd, then the two rows are blended in 32 bits.
+        __m256 gx = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256 gy = _mm256_setzero_ps();
+        const __m256 sizef = _mm256_set1_ps((float)size);
+        const __m256 eight = _mm256_set1_ps(8.0f);
+        const __m256 half  = _mm256_set1_ps(0.5f);
+        const __m256 unit  = _mm256_set1_ps(256.0f);
+        wrapGrid(gx, gy, sizef);
+
+        const __m256i weight = _mm256_set1_epi32(256);
+        const __m256i round  = _mm256_set1_epi32(1 << (shift - 1));
+
+        // Shuffles taking byte c of every lane to its lowest byte, or to its third byte. Other bytes are cleared.
+        const __m256i lanes = _mm256_setr_epi32(0, 4, 8, 12, 0, 4, 8, 12);
+        __m256i lows[3], highs[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            lows[c]  = _mm256_add_epi32(lanes, _mm256_set1_epi32((int)0x80808000u + c));
+            highs[c] = _mm256_add_epi32(_mm256_slli_epi32(lanes, 16), _mm256_set1_epi32((int)0x80008080u + (c << 16)));
+        }
+
+        __m256i vsums[3] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+        for (; k + 8 <= num; k += 8)
+        {
+            const __m256 x = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(left[0]), _mm256_mul_ps(gx, _mm256_set1_ps(dx[0]))), _mm256_mul_ps(gy, _mm256_set1_ps(dy[0])));
+            const __m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(left[1]), _mm256_mul_ps(gx, _mm256_set1_ps(dx[1]))), _mm256_mul_ps(gy, _mm256_set1_ps(dy[1])));
+
+            const __m256 fx = _mm256_floor_ps(x);
+            const __m256 fy = _mm256_floor_ps(y);
+            const __m256i wx1 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(x, fx), unit), half));
+            const __m256i wy1 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(y, fy), unit), half));
+            const __m256i wy0 = _mm256_sub_epi32(weight, wy1);
+            const __m256i wx  = _mm256_or_si256(_mm256_sub_epi32(weight, wx1), _mm256_slli_epi32(wx1, 16));
+
+            __m256i offsets[4];
+            cornerOffsets(view, fx, fy, offsets);
+            const __m256i c00 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[0], 1);
+            const __m256i c10 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[1], 1);
+            const __m256i c01 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[2], 1);
+            const __m256i c11 = _mm256_i32gather_epi32((const int*)view.m_pixels, offsets[3], 1);
+
+            for (int c = 0; c < 3; ++c)
+            {
+                const __m256i top    = _mm256_madd_epi16(_mm256_or_si256(_mm256_shuffle_epi8(c00, lows[c]), _mm256_shuffle_epi8(c10, highs[c])), wx);
+                const __m256i bottom = _mm256_madd_epi16(_mm256_or_si256(_mm256_shuffle_epi8(c01, lows[c]), _mm256_shuffle_epi8(c11, highs[c])), wx);
+                const __m256i color  = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(top, wy0), _mm256_mullo_epi32(bottom, wy1)), round), shift);
+                vsums[c] = _mm256_add_epi32(vsums[c], color);
+
+                // The eight colors as shorts, in order in the low half
+                const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(color, color), 0x08);
+                _mm_storeu_si128((__m128i*)(tex + c * stride + k), _mm256_castsi256_si128(packed));
+            }
+
+            gx = _mm256_add_ps(gx, eight);
+            wrapGrid(gx, gy, sizef);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            int out[8];
+            _mm256_storeu_si256((__m256i*)out, vsums[c]);
+            sums[c] = out[0] + out[1] + out[2] + out[3] + out[4] + out[5] + out[6] + out[7];
+        }
+#endif
+
+        for (; k < num; ++k)
+        {
+            const Vec3f pos = left + dx * (float)(k % size) + dy * (float)(k / size);
+            const int lx = (int)floor(pos[0]);
+            const int ly = (int)floor(pos[1]);
+            const int wx1 = (int)((pos[0] - lx) * 256.0f + 0.5f);  const int wx0 = 256 - wx1;
+            const int wy1 = (int)((pos[1] - ly) * 256.0f + 0.5f);  const int wy0 = 256 - wy1;
+
+            const unsigned char* pixels[4];
+            corners(view, lx, ly, pixels);
+            for (int c = 0; c < 3; ++c)
+            {
+                const int top    = pixels[0][c] * wx0 + pixels[1][c] * wx1;
+                const int bottom = pixels[2][c] * wx0 + pixels[3][c] * wx1;
+                const int color  = (top * wy0 + bottom * wy1 + (1 << (shift - 1))) >> shift;
+                tex[c * stride + k] = (short)color;
+                sums[c] += color;
+            }
+        }
+
+        for (int c = 0; c < 3; ++c)
+            std::fill(tex + c * stride + num, tex + (c + 1) * stride, (short)0);
+    }
+
+    // Dot product of two planes of num samples, num a multiple of 8
+    long long dotFixed(const short* const t0, const short* const t1, const int num)
+    {
+        long long ans = 0;
+        int i = 0;
+#ifdef PMVS_SSE2
+        // Products of two samples are below 2^24, so 32 blocks of pairs fit in the 32 bit lanes
+        while (i < num)
+        {
+            const int end = std::min(num, i + 32 * 8);
+            __m128i acc = _mm_setzero_si128();
+            for (; i < end; i += 8)
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(t0 + i)), _mm_loadu_si128((const __m128i*)(t1 + i))));
+
+            int out[4];
+            _mm_storeu_si128((__m128i*)out, acc);
+            ans += (long long)out[0] + out[1] + out[2] + out[3];
+        }
+#endif
+        for (; i < num; ++i) ans += t0[i] * t1[i];
+
+        return ans;
+    }
+
+    // ncc of two fixed point textures of num samples per plane given the sums of their planes and their scales.
+    // Same as computeZNCC on the corresponding float textures.
+    float computeZNCCFixed(const short* const t0, const int* const sums0, const float scale0,
+                           const short* const t1, const int* const sums1, const float scale1, const int num, const int stride)
+    {
+        double cross = 0.0;
+        for (int c = 0; c < 3; ++c)
+            cross += (double)dotFixed(t0 + c * stride, t1 + c * stride, stride) - (double)sums0[c] * sums1[c] / num;
+
+        return (float)(cross / (1 << (2 * FixedBits)) / (3 * num * scale0 * scale1));
+    }
+
+    // Mean color and scale of a fixed point texture, as returned by sampleTex for the float one
+    void statsFixed(const short* const tex, const int* const sums, const int num, const int stride, Vec3f& ave, float& scale)
+    {
+        double var = 0.0;
+        for (int c = 0; c < 3; ++c)
+        {
+            ave[c] = (float)sums[c] / (num << FixedBits);
+            var += (double)dotFixed(tex + c * stride, tex + c * stride, stride) - (double)sums[c] * sums[c] / num;
+        }
+
+        scale = (float)sqrt(std::max(0.0, var) / (1 << (2 * FixedBits)) / (3 * num));
+        if (scale == 0.0f) scale = 1.0f;
+    }
+
+}
 
 Coptim::Coptim(CfindMatch& findMatch)
     : m_fm(findMatch)
 {
-    m_one = this;
-
     m_status.resize(35);
     fill(m_status.begin(), m_status.end(), 0);  
 }
 
 void Coptim::init(void)
 {
-    m_vect0T.resize(m_fm.m_CPU);
-    m_centersT.resize(m_fm.m_CPU);
-    m_raysT.resize(m_fm.m_CPU);
-    m_indexesT.resize(m_fm.m_CPU);
-    m_dscalesT.resize(m_fm.m_CPU);
-    m_ascalesT.resize(m_fm.m_CPU);
-    m_paramsT.resize(m_fm.m_CPU);
-
-    m_texsT.resize(m_fm.m_CPU);
-    m_weightsT.resize(m_fm.m_CPU);
-
-    for (int c = 0; c < m_fm.m_CPU; ++c)
+    // Window sizes with specialized kernels, others use the generic ones
+    switch (m_fm.m_wsize)
     {
-        m_texsT[c].resize(m_fm.m_num);
-        m_weightsT[c].resize(m_fm.m_num);
-        for (int j = 0; j < m_fm.m_tau; ++j) m_texsT[c][j].resize(3 * m_fm.m_wsize * m_fm.m_wsize);
+    case 5:     setKernels<5>();    break;
+    case 7:     setKernels<7>();    break;
+    case 9:     setKernels<9>();    break;
+    case 11:    setKernels<11>();   break;
+    default:    setKernels<0>();    break;
     }
 
+    m_fixedStride = (m_fm.m_wsize * m_fm.m_wsize + 7) / 8 * 8;
+
     setAxesScales();
+
+    if (m_fm.m_fixedPoint) checkFixedPoint();
+}
+
+void Coptim::initContext(CoptimContext& context) const
+{
+    const int tsize = 3 * m_fm.m_wsize * m_fm.m_wsize;
+
+    context.m_texs.resize(2);
+    context.m_dtexs.resize(2);
+    for (int j = 0; j < 2; ++j)
+    {
+        context.m_texs[j].resize(tsize);
+        context.m_dtexs[j].resize(3 * tsize);
+    }
+
+    context.m_ttexs.resize(m_fm.m_num, tsize);
+    if (m_fm.m_fixedPoint)
+    {
+        context.m_tfixed.resize(m_fm.m_num, 3 * m_fixedStride);
+        context.m_tsums.resize(3 * m_fm.m_num);
+    }
+    context.m_tnormalized.resize(m_fm.m_num, tsize);
+    context.m_taves.resize(m_fm.m_num);
+    context.m_tscales.resize(m_fm.m_num);
+    context.m_tstamps.assign(m_fm.m_num, 0);
+    context.m_tstamp = 0;
+    context.m_tref   = -1;
+
+    // Sized for all the images so that refining a patch never allocates
+    context.m_indexes.reserve(m_fm.m_num);
+    context.m_weights.resize(m_fm.m_num);
+
+    context.m_cascadeTrials.assign(m_fm.m_cascade, 0);
+    context.m_cascadeRejects.assign(m_fm.m_cascade, 0);
+
+    context.m_pinned.clear();
+    context.m_isPinned.assign(m_fm.m_num, 0);
+}
+
+template<int W>
+void Coptim::setKernels(void)
+{
+    m_computeINCCW = &Coptim::computeINCCW<W>;
+    m_grabTexsW    = &Coptim::grabTexsW<W>;
+    m_evaluateGNW  = &Coptim::evaluateGNW<W>;
 }
 
 void Coptim::setAxesScales(void)
@@ -133,6 +711,30 @@ void Coptim::setAxesScales(void)
     }
 }
 
+void Coptim::pinImage(const int image, CoptimContext& context) const
+{
+    if (m_fm.m_pss.m_budget == 0 || context.m_isPinned[image]) return;
+
+    m_fm.m_pss.pin(image);
+    context.m_isPinned[image] = 1;
+    context.m_pinned.push_back(image);
+}
+
+void Coptim::pinImages(const std::vector<int>& images, CoptimContext& context) const
+{
+    for (int i = 0; i < (int)images.size(); ++i) pinImage(images[i], context);
+}
+
+void Coptim::unpinImages(CoptimContext& context) const
+{
+    for (int i = 0; i < (int)context.m_pinned.size(); ++i)
+    {
+        m_fm.m_pss.unpin(context.m_pinned[i]);
+        context.m_isPinned[context.m_pinned[i]] = 0;
+    }
+    context.m_pinned.clear();
+}
+
 void Coptim::collectImages(const int index, std::vector<int>& indexes) const
 {
     // Find images with constraints m_angleThreshold, m_visdata, m_sequenceThreshold, m_targets. Results are sorted by CphotoSet::m_distances.
@@ -160,12 +762,12 @@ void Coptim::collectImages(const int index, std::vector<int>& indexes) const
     for (int i = 0; i < std::min(m_fm.m_tau, (int)candidates.size()); ++i) indexes.push_back((int)candidates[i][1]);
 }
 
-int Coptim::preProcess(Cpatch& patch, const int id, const int seed)
+int Coptim::preProcess(Cpatch& patch, CoptimContext& context, const int seed)
 {
-    addImages(patch);
+    addImages(patch, context);
 
     // Here define reference images, and sort images. Something similar to constraintImages is done inside.
-    constraintImages(patch, m_fm.m_nccThresholdBefore, id);
+    constraintImages(patch, m_fm.m_nccThresholdBefore, context);
 
     // Fix the reference image and sort the other m_tau - 1 images.
     sortImages(patch);
@@ -191,9 +793,87 @@ int Coptim::preProcess(Cpatch& patch, const int id, const int seed)
         return 1;
     }
 
+    if (m_fm.m_cascade && checkCascade(patch, context)) return 1;
+
     return 0;
 }
 
+int Coptim::checkCascade(const Cpatch& patch, CoptimContext& context)
+{
+    const int size  = std::min(m_fm.m_tau, (int)patch.m_images.size());
+    const int wsize = m_fm.m_cascadeWsize;
+
+    Vec4f pxaxis, pyaxis;
+    getPAxes(patch.m_images[0], patch.m_coord, patch.m_normal, pxaxis, pyaxis);
+
+    float* const tex0 = &context.m_texs[0][0];
+    float* const tex1 = &context.m_texs[1][0];
+
+    // From the coarsest level down. Scaling the sampling step makes grabGrid pick the coarser level.
+    for (int stage = 0; stage < m_fm.m_cascade; ++stage)
+    {
+        ++context.m_cascadeTrials[stage];
+
+        const float step = (float)(1 << (m_fm.m_cascade - stage));
+        const Vec4f xaxis = pxaxis * step;
+        const Vec4f yaxis = pyaxis * step;
+
+        Vec3f left, dx, dy, ave0, ave1;
+        int level;
+        float scale, scale0, scale1;
+
+        int count = 0;
+        if (grabGrid(patch.m_coord, xaxis, yaxis, patch.m_normal, patch.m_images[0], wsize, left, dx, dy, level, scale) == 0)
+        {
+            const Image::SimageView view = m_fm.m_pss.m_photos[patch.m_images[0]].getView(level);
+            sampleTex<0>(view, left, dx, dy, wsize, tex0, ave0, scale0);
+
+            for (int i = 1; i < size; ++i)
+            {
+                const int image = patch.m_images[i];
+                if (grabGrid(patch.m_coord, xaxis, yaxis, patch.m_normal, image, wsize, left, dx, dy, level, scale)) continue;
+
+                const Image::SimageView view1 = m_fm.m_pss.m_photos[image].getView(level);
+                sampleTex<0>(view1, left, dx, dy, wsize, tex1, ave1, scale1);
+                if (m_fm.m_cascadeThreshold <= computeZNCC<0>(tex0, ave0, scale0, tex1, ave1, scale1, 3 * wsize * wsize)) ++count;
+            }
+        }
+
+        if (count < m_fm.m_minImageNumThreshold - 1)
+        {
+            ++context.m_cascadeRejects[stage];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void Coptim::clearCascadeCounts(void)
+{
+    m_cascadeTrials.assign(m_fm.m_cascade, 0);
+    m_cascadeRejects.assign(m_fm.m_cascade, 0);
+}
+
+void Coptim::addCascadeCounts(const CoptimContext& context)
+{
+    for (int stage = 0; stage < m_fm.m_cascade; ++stage)
+    {
+        m_cascadeTrials[stage]  += context.m_cascadeTrials[stage];
+        m_cascadeRejects[stage] += context.m_cascadeRejects[stage];
+    }
+}
+
+void Coptim::printCascadeCounts(void) const
+{
+    for (int stage = 0; stage < m_fm.m_cascade; ++stage)
+    {
+        std::cerr << "Cascade stage " << stage << " (level " << m_fm.m_level + m_fm.m_cascade - stage << ") trial reject: "
+                  << m_cascadeTrials[stage] << ' ' << m_cascadeRejects[stage] << ' '
+                  << 100 * m_cascadeRejects[stage] / (float)std::max(1, m_cascadeTrials[stage]) << '%' << std::endl;
+    }
+}
+
 void Coptim::filterImagesByAngle(Cpatch& patch)
 {
     std::vector<int> newindexes;
@@ -223,22 +903,22 @@ void Coptim::filterImagesByAngle(Cpatch& patch)
     patch.m_images.swap(newindexes);
 }
 
-int Coptim::postProcess(Cpatch& patch, const int id, const int seed)
+int Coptim::postProcess(Cpatch& patch, CoptimContext& context, const int seed)
 {
     if ((int)patch.m_images.size() < m_fm.m_minImageNumThreshold) return 1;
     if (m_fm.m_pss.getMask(patch.m_coord, m_fm.m_level) == 0 || m_fm.insideBimages(patch.m_coord) == 0) return 1;
 
-    addImages(patch);
+    addImages(patch, context);
 
-    constraintImages(patch, m_fm.m_nccThreshold, id);
+    constraintImages(patch, m_fm.m_nccThreshold, context);
     filterImagesByAngle(patch);
 
     if ((int)patch.m_images.size() < m_fm.m_minImageNumThreshold) return 1;
 
     m_fm.m_pos.setGrids(patch);
 
-    setRefImage(patch, id);
-    constraintImages(patch, m_fm.m_nccThreshold, id);
+    setRefImage(patch, context);
+    constraintImages(patch, m_fm.m_nccThreshold, context);
 
     if ((int)patch.m_images.size() < m_fm.m_minImageNumThreshold) return 1;
 
@@ -267,22 +947,33 @@ int Coptim::postProcess(Cpatch& patch, const int id, const int seed)
     return 0;
 }
 
-void Coptim::constraintImages(Cpatch& patch, const float nccThreshold, const int id)
+void Coptim::constraintImages(Cpatch& patch, const float nccThreshold, CoptimContext& context)
 {
-    std::vector<float> inccs;
-    setINCCs(patch, inccs, patch.m_images, id, 0);
+    const std::vector<int>& indexes = patch.m_images;
+    const int size  = (int)indexes.size();
+    const int index = indexes[0];
+
+    (this->*m_grabTexsW)(patch.m_coord, patch.m_normal, indexes, 0, 1, context);
 
-    // Constraint images
+    // Every caller rejects the patch when fewer than m_minImageNumThreshold images are left, so stop grabbing
+    // textures as soon as that is certain. The images kept so far are too few as well.
     std::vector<int> newimages;
-    newimages.push_back(patch.m_images[0]);
-    for (int i = 1; i < (int)patch.m_images.size(); ++i)
+    newimages.push_back(index);
+    for (int i = 1; i < size && context.m_tscales[index] != 0.0f; ++i)
     {
-        if (inccs[i] < 1.0f - nccThreshold) newimages.push_back(patch.m_images[i]);
+        if ((int)newimages.size() + size - i < m_fm.m_minImageNumThreshold) break;
+
+        const int image = indexes[i];
+        (this->*m_grabTexsW)(patch.m_coord, patch.m_normal, indexes, i, i + 1, context);
+        if (context.m_tscales[image] == 0.0f) continue;
+
+        const float ncc = textureZNCC(context, index, image);
+        if (1.0f - ncc < 1.0f - nccThreshold) newimages.push_back(image);
     }
     patch.m_images.swap(newimages);
 }
 
-void Coptim::setRefImage(Cpatch& patch, const int id)
+void Coptim::setRefImage(Cpatch& patch, CoptimContext& context)
 {
     // Set the reference image only for target images
     std::vector<int> indexes;
@@ -302,7 +993,7 @@ void Coptim::setRefImage(Cpatch& patch, const int id)
     }
 
     std::vector<std::vector<float> > inccs;
-    setINCCs(patch, inccs, indexes, id, 1);
+    setINCCs(patch, inccs, indexes, context, 1);
 
     int refindex = -1;
     float refncc = INT_MAX/2;
@@ -451,7 +1142,7 @@ void Coptim::removeImagesEdge(Patch::Cpatch& patch) const
     patch.m_images.swap(newindexes);
 }
 
-void Coptim::addImages(Patch::Cpatch& patch) const
+void Coptim::addImages(Patch::Cpatch& patch, CoptimContext& context) const
 {
     // Take into account m_edge
     std::vector<int> used(m_fm.m_num, 0);
@@ -494,7 +1185,11 @@ void Coptim::addImages(Patch::Cpatch& patch) const
         unitize(ray);
         const float ftmp = ray * patch.m_normal;
 
-        if (athreshold <= ftmp) patch.m_images.push_back(*bimage);
+        if (athreshold <= ftmp)
+        {
+            patch.m_images.push_back(*bimage);
+            pinImage(*bimage, context);
+        }
 
         ++bimage;
     }
@@ -550,176 +1245,217 @@ void Coptim::computeUnits(const Patch::Cpatch& patch, std::vector<int>& indexes,
     }
 }
 
-void Coptim::my_f_lm(const Eigen::VectorXd &par, Eigen::VectorXd &fvec, int id)
+double Coptim::evaluateGN(const double* const vect, Eigen::Matrix3d& H, Eigen::Vector3d& g, CoptimContext& context)
 {
-    double xs[3] = {par[0], par[1], par[2]};
-
-    const double angle1 = xs[1] * m_one->m_ascalesT[id];
-    const double angle2 = xs[2] * m_one->m_ascalesT[id];
-
-    double ret = 0.0;
-
-    if (angle1 <= - M_PI / 2.0 || M_PI / 2.0 <= angle1 || angle2 <= - M_PI / 2.0 || M_PI / 2.0 <= angle2)
-    {
-        ret = 2.0;
+    return (this->*m_evaluateGNW)(vect, H, g, context);
+}
 
-        fvec[0] = ret;
-        fvec[1] = ret;
-        fvec[2] = ret;
+template<int W>
+double Coptim::evaluateGNW(const double* const vect, Eigen::Matrix3d& H, Eigen::Vector3d& g, CoptimContext& context)
+{
+    const double angle1 = vect[1] * context.m_ascale;
+    const double angle2 = vect[2] * context.m_ascale;
 
-        return;
-    }
+    if (angle1 <= - M_PI / 2.0 || M_PI / 2.0 <= angle1 || angle2 <= - M_PI / 2.0 || M_PI / 2.0 <= angle2) return 2.0;
 
-    Vec4f coord, normal;
-    m_one->decode(coord, normal, xs, id);
+    Vec4f coord, normal, dcoord[3], dnormal[3];
+    decode(coord, normal, dcoord, dnormal, vect, context);
 
-    const int index = m_one->m_indexesT[id][0];
-    Vec4f pxaxis, pyaxis;
-    m_one->getPAxes(index, coord, normal, pxaxis, pyaxis);
+    const int index = context.m_indexes[0];
+    Vec4f pxaxis, pyaxis, dpxaxis[3], dpyaxis[3];
+    getPAxes(index, coord, normal, dcoord, dnormal, pxaxis, pyaxis, dpxaxis, dpyaxis);
 
-    const int size    = std::min(m_one->m_fm.m_tau, (int)m_one->m_indexesT[id].size());
-    const int mininum = std::min(m_one->m_fm.m_minImageNumThreshold, size);
+    const int size    = std::min(m_fm.m_tau, (int)context.m_indexes.size());
+    const int mininum = std::min(m_fm.m_minImageNumThreshold, size);
+    const int tsize   = W ? 3 * W * W : 3 * m_fm.m_wsize * m_fm.m_wsize;
 
-    for (int i = 0; i < size; ++i)
-    {
-        int flag;
-        flag = m_one->grabTex(coord, pxaxis, pyaxis, normal, m_one->m_indexesT[id][i], m_one->m_fm.m_wsize, m_one->m_texsT[id][i]);
+    // The reference texture and the one being compared, on the stack for the specialized sizes
+    float texbuf[2][W ? 3 * W * W : 1];
+    float dtexbuf[2][W ? 9 * W * W : 1];
+    float* const tex0  = W ? texbuf[0]  : &context.m_texs[0][0];
+    float* const tex1  = W ? texbuf[1]  : &context.m_texs[1][0];
+    float* const dtex0 = W ? dtexbuf[0] : &context.m_dtexs[0][0];
+    float* const dtex1 = W ? dtexbuf[1] : &context.m_dtexs[1][0];
 
-        if (flag == 0) m_one->normalize(m_one->m_texsT[id][i]);
-    }
+    float scale0;
+    if (grabTex<W>(coord, pxaxis, pyaxis, normal, dcoord, dpxaxis, dpyaxis, index, tex0, dtex0, scale0)) return 2.0;
 
-    if (m_one->m_texsT[id][0].empty()) ret = 2.0;
+    H.setZero();
+    g.setZero();
 
     double ans = 0.0;
     int denom  = 0;
     for (int i = 1; i < size; ++i)
     {
-        if (m_one->m_texsT[id][i].empty()) continue;
-        ans += (double)robustincc(1.0 - m_one->dot(m_one->m_texsT[id][0], m_one->m_texsT[id][i]));
-        denom++;
-    }
-
-    if (denom < mininum - 1) ret = 2.0;
-    else                     ret = ans / denom;
-
-    fvec[0] = ret;
-    fvec[1] = ret;
-    fvec[2] = ret;
-}
-
-void Coptim::my_f_lm(const Eigen::VectorXf &par, Eigen::VectorXf &fvec, int id)
-{
-    double xs[3] = {par[0], par[1], par[2]};
+        float scale1;
+        if (grabTex<W>(coord, pxaxis, pyaxis, normal, dcoord, dpxaxis, dpyaxis, context.m_indexes[i], tex1, dtex1, scale1)) continue;
 
-    const double angle1 = xs[1] * m_one->m_ascalesT[id];
-    const double angle2 = xs[2] * m_one->m_ascalesT[id];
+        float ncc = 0.0f;
+        for (int k = 0; k < tsize; ++k) ncc += tex0[k] * tex1[k];
+        ncc /= tsize;
 
-    double ret = 0.0;
+        const float incc = std::max(0.0f, 1.0f - ncc);
+        const float rncc = robustincc(incc);
+        ans += (double)rncc;
+        denom++;
 
-    if (angle1 <= - M_PI / 2.0 || M_PI / 2.0 <= angle1 || angle2 <= - M_PI / 2.0 || M_PI / 2.0 <= angle2)
-    {
-        ret = 2.0;
+        // Derivative of ncc through both normalized textures
+        float dncc[3] = {0.0f, 0.0f, 0.0f};
+        for (int k = 0; k < tsize; ++k)
+        {
+            const float f0 = (tex0[k] - ncc * tex1[k]) / scale1;
+            const float f1 = (tex1[k] - ncc * tex0[k]) / scale0;
+            for (int p = 0; p < 3; ++p) dncc[p] += dtex1[3 * k + p] * f0 + dtex0[3 * k + p] * f1;
+        }
 
-        fvec[0] = ret;
-        fvec[1] = ret;
-        fvec[2] = ret;
+        // The cost is the sum of the robust inccs, i.e. the sum of squares of their square roots
+        const float ftmp = 1.0f + 3.0f * incc;
+        const double residual = std::max(1.0e-4, sqrt((double)rncc));
+        const double factor   = -1.0 / (ftmp * ftmp) / tsize / (2.0 * residual);
 
-        return;
+        const Eigen::Vector3d jacobian = Eigen::Vector3d(dncc[0], dncc[1], dncc[2]) * factor;
+        H += jacobian * jacobian.transpose();
+        g += jacobian * residual;
     }
 
-    Vec4f coord, normal;
-    m_one->decode(coord, normal, xs, id);
+    if (denom < mininum - 1) return 2.0;
 
-    const int index = m_one->m_indexesT[id][0];
-    Vec4f pxaxis, pyaxis;
-    m_one->getPAxes(index, coord, normal, pxaxis, pyaxis);
+    H /= denom;
+    g /= denom;
 
-    const int size    = std::min(m_one->m_fm.m_tau, (int)m_one->m_indexesT[id].size());
-    const int mininum = std::min(m_one->m_fm.m_minImageNumThreshold, size);
+    return ans / denom;
+}
 
-    for (int i = 0; i < size; ++i)
-    {
-        int flag;
-        flag = m_one->grabTex(coord, pxaxis, pyaxis, normal, m_one->m_indexesT[id][i], m_one->m_fm.m_wsize, m_one->m_texsT[id][i]);
+double Coptim::searchDepth(double* const vect, CoptimContext& context)
+{
+    // Samples in units of m_dscale around the current depth
+    const int num = 5;
+    const double step = 0.5;
 
-        if (flag == 0) m_one->normalize(m_one->m_texsT[id][i]);
+    Vec4f coord, normal;
+    double costs[num];
+    int best = num / 2;
+    for (int i = 0; i < num; ++i)
+    {
+        const double q[3] = {vect[0] + (i - num / 2) * step, vect[1], vect[2]};
+        decode(coord, normal, q, context);
+        costs[i] = computeINCC(coord, normal, context.m_indexes, context, 1);
+        if (costs[i] < costs[best]) best = i;
     }
 
-    if (m_one->m_texsT[id][0].empty()) ret = 2.0;
+    double depth = vect[0] + (best - num / 2) * step;
+    double cost = costs[best];
 
-    double ans = 0.0;
-    int denom  = 0;
-    for (int i = 1; i < size; ++i)
+    // Vertex of the parabola through the best sample and its neighbors
+    if (0 < best && best < num - 1 && costs[best - 1] < 2.0 && costs[best + 1] < 2.0)
     {
-        if (m_one->m_texsT[id][i].empty()) continue;
-        ans += (double)robustincc(1.0 - m_one->dot(m_one->m_texsT[id][0], m_one->m_texsT[id][i]));
-        denom++;
+        const double denom = costs[best - 1] - 2.0 * costs[best] + costs[best + 1];
+        if (0.0 < denom)
+        {
+            const double q[3] = {depth + 0.5 * step * (costs[best - 1] - costs[best + 1]) / denom, vect[1], vect[2]};
+            decode(coord, normal, q, context);
+            const double newcost = computeINCC(coord, normal, context.m_indexes, context, 1);
+            if (newcost < cost)
+            {
+                depth = q[0];
+                cost = newcost;
+            }
+        }
     }
 
-    if (denom < mininum - 1) ret = 2.0;
-    else                     ret = ans / denom;
-
-    fvec[0] = ret;
-    fvec[1] = ret;
-    fvec[2] = ret;
+    vect[0] = depth;
+    return cost;
 }
 
-bool Coptim::refinePatchBFGS(Cpatch& patch, const int id)
+bool Coptim::refinePatchBFGS(Cpatch& patch, CoptimContext& context)
 {
-    m_centersT[id] = patch.m_coord;
-    m_raysT[id]    = patch.m_coord - m_fm.m_pss.m_photos[patch.m_images[0]].m_center;
-    unitize(m_raysT[id]);
-    m_indexesT[id] = patch.m_images;
+    context.m_center = patch.m_coord;
+    context.m_ray    = patch.m_coord - m_fm.m_pss.m_photos[patch.m_images[0]].m_center;
+    unitize(context.m_ray);
+    context.m_indexes = patch.m_images;
 
-    m_dscalesT[id] = patch.m_dscale;
-    m_ascalesT[id] = (float)M_PI / 48.0f;
+    context.m_dscale = patch.m_dscale;
+    context.m_ascale = (float)M_PI / 48.0f;
 
-    setWeightsT(patch, id);
+    setWeights(patch, context);
 
     double p[3];
-    encode(patch.m_coord, patch.m_normal, p, id);
-
-    Eigen::VectorXf x(3);
-    x << p[0], p[1], p[2];
+    encode(patch.m_coord, patch.m_normal, p, context);
 
-    LMRefinePatch<float> functor(id);
-    Eigen::NumericalDiff<LMRefinePatch<float>> numDiff(functor);
-    Eigen::LevenbergMarquardt<Eigen::NumericalDiff<LMRefinePatch<float>>, float> lm(numDiff);
+    if (m_fm.m_depthSearch)
+    {
+        // Give up early when even the best depth is not photo-consistent.
+        // postProcess then rejects the patch as it has no images left.
+        const double depthCost = searchDepth(p, context);
+        if (2.0 <= depthCost || 1.0f - unrobustincc(depthCost) < m_fm.m_nccThresholdBefore)
+        {
+            patch.m_images.clear();
+            return false;
+        }
+    }
 
-    lm.parameters.ftol   = 1.0e-7;
-    lm.parameters.xtol   = 1.0e-7;
-    lm.parameters.maxfev = 100;
+    // Levenberg-Marquardt damped Gauss-Newton with analytic derivatives
+    const int maxIteration = 20;
+    const double ftol = 1.0e-4;
+    const double xtol = 1.0e-2;
+    // Largest step per iteration, in units of m_dscale and m_ascale
+    const double maxStep = 0.5;
 
-    auto status = lm.minimize(x);
+    Eigen::Matrix3d H, Htmp;
+    Eigen::Vector3d g, gtmp;
 
-    p[0] = x[0];
-    p[1] = x[1];
-    p[2] = x[2];
+    double cost = evaluateGN(p, H, g, context);
+    if (2.0 <= cost) return false;
 
-    // ret 0 to 3 are "good", the rest are bad
-    if (status >= 0 && status <= 3)
+    double lambda = 1.0e-3;
+    for (int iteration = 0; iteration < maxIteration; ++iteration)
     {
-        decode(patch.m_coord, patch.m_normal, p, id);
+        Eigen::Matrix3d A = H;
+        for (int j = 0; j < 3; ++j) A(j, j) += lambda * std::max(H(j, j), 1.0e-12);
 
-        patch.m_ncc = 1.0f - unrobustincc(computeINCC(patch.m_coord, patch.m_normal, patch.m_images, id, 1));
-    } else
-    {
-        return false;
+        Eigen::Vector3d step = A.ldlt().solve(-g);
+        const double length = step.lpNorm<Eigen::Infinity>();
+        if (length <= xtol) break;
+        // The angular directions are often nearly flat, so bound the step
+        if (maxStep < length) step *= maxStep / length;
+
+        const double q[3] = {p[0] + step[0], p[1] + step[1], p[2] + step[2]};
+
+        const double newcost = evaluateGN(q, Htmp, gtmp, context);
+        if (newcost < cost)
+        {
+            const double decrease = cost - newcost;
+            std::copy(q, q + 3, p);
+            H    = Htmp;
+            g    = gtmp;
+            cost = newcost;
+            lambda = std::max(1.0e-7, lambda / 10.0);
+
+            if (decrease <= ftol * cost) break;
+        } else
+        {
+            lambda *= 10.0;
+            if (1.0e+5 < lambda) break;
+        }
     }
 
+    decode(patch.m_coord, patch.m_normal, p, context);
+
+    patch.m_ncc = 1.0f - unrobustincc(computeINCC(patch.m_coord, patch.m_normal, patch.m_images, context, 1));
+
     return true;
 }
 
-void Coptim::encode(const Vec4f& coord, double* const vect, const int id) const
+void Coptim::encode(const Vec4f& coord, double* const vect, const CoptimContext& context) const
 {
-    vect[0] = (coord - m_centersT[id]) * m_raysT[id] / m_dscalesT[id];
+    vect[0] = (coord - context.m_center) * context.m_ray / context.m_dscale;
 }
 
-void Coptim::encode(const Vec4f& coord, const Vec4f& normal, double* const vect, const int id) const
+void Coptim::encode(const Vec4f& coord, const Vec4f& normal, double* const vect, const CoptimContext& context) const
 {
-    encode(coord, vect, id);
+    encode(coord, vect, context);
 
-    const int image = m_indexesT[id][0];
+    const int image = context.m_indexes[0];
     const float fx = m_xaxes[image] * proj(normal); // Projects from 4D to 3D, divide by last value
     const float fy = m_yaxes[image] * proj(normal);
     const float fz = m_zaxes[image] * proj(normal);
@@ -738,17 +1474,17 @@ void Coptim::encode(const Vec4f& coord, const Vec4f& normal, double* const vect,
         if (sina < 0.0f) vect[1] = - vect[1];
     }
 
-    vect[1] = vect[1] / m_ascalesT[id];
-    vect[2] = vect[2] / m_ascalesT[id];  
+    vect[1] = vect[1] / context.m_ascale;
+    vect[2] = vect[2] / context.m_ascale;  
 }
 
-void Coptim::decode(Vec4f& coord, Vec4f& normal, const double* const vect, const int id) const
+void Coptim::decode(Vec4f& coord, Vec4f& normal, const double* const vect, const CoptimContext& context) const
 {
-    decode(coord, vect, id);
-    const int image = m_indexesT[id][0];
+    decode(coord, vect, context);
+    const int image = context.m_indexes[0];
 
-    const float angle1 = vect[1] * m_ascalesT[id];
-    const float angle2 = vect[2] * m_ascalesT[id];
+    const float angle1 = vect[1] * context.m_ascale;
+    const float angle2 = vect[2] * context.m_ascale;
 
     const float fx = sin(angle1) * cos(angle2);
     const float fy = sin(angle2);
@@ -758,66 +1494,116 @@ void Coptim::decode(Vec4f& coord, Vec4f& normal, const double* const vect, const
     normal = Vec4f(ftmp[0], ftmp[1], ftmp[2], 0.0f);
 }
 
-void Coptim::decode(Vec4f& coord, const double* const vect, const int id) const
+void Coptim::decode(Vec4f& coord, const double* const vect, const CoptimContext& context) const
 {
-    coord = m_centersT[id] + m_dscalesT[id] * (float)vect[0] * m_raysT[id];
+    coord = context.m_center + context.m_dscale * (float)vect[0] * context.m_ray;
 }
 
-void Coptim::setINCCs(const Patch::Cpatch& patch, std::vector<float> & inccs, const std::vector<int>& indexes, const int id, const int robust)
+void Coptim::decode(Vec4f& coord, Vec4f& normal, Vec4f* const dcoord, Vec4f* const dnormal, const double* const vect, const CoptimContext& context) const
 {
-    const int index = indexes[0];
-    Vec4f pxaxis, pyaxis;
-    getPAxes(index, patch.m_coord, patch.m_normal, pxaxis, pyaxis);
+    decode(coord, normal, vect, context);
+    const int image = context.m_indexes[0];
 
-    auto& texs = m_texsT[id];
+    const float angle1 = vect[1] * context.m_ascale;
+    const float angle2 = vect[2] * context.m_ascale;
 
-    const int size = (int)indexes.size();
-    for (int i = 0; i < size; ++i)
-    {
-        const int flag = grabTex(patch.m_coord, pxaxis, pyaxis, patch.m_normal, indexes[i], m_fm.m_wsize, texs[i]);
-        if (flag == 0) normalize(texs[i]);
-    }
+    const float sin1 = sin(angle1);  const float cos1 = cos(angle1);
+    const float sin2 = sin(angle2);  const float cos2 = cos(angle2);
 
-    inccs.resize(size);
+    dcoord[0] = context.m_dscale * context.m_ray;
+    dcoord[1] = dcoord[2] = Vec4f();
+
+    const Vec3f dn1 = (m_xaxes[image] * (cos1 * cos2) + m_zaxes[image] * (sin1 * cos2)) * context.m_ascale;
+    const Vec3f dn2 = (m_xaxes[image] * (- sin1 * sin2) + m_yaxes[image] * cos2 + m_zaxes[image] * (cos1 * sin2)) * context.m_ascale;
+
+    dnormal[0] = Vec4f();
+    dnormal[1] = Vec4f(dn1[0], dn1[1], dn1[2], 0.0f);
+    dnormal[2] = Vec4f(dn2[0], dn2[1], dn2[2], 0.0f);
+}
+
+template<int W>
+void Coptim::grabTexsW(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, const int begin, const int end,
+                       CoptimContext& context)
+{
+    const int index = indexes[0];
 
-    if (texs[0].empty())
+    // Textures grabbed for another patch or reference image are stale
+    if (coord != context.m_tcoord || normal != context.m_tnormal || index != context.m_tref)
     {
-        fill(inccs.begin(), inccs.end(), 2.0f);
-        return;
+        context.m_tcoord  = coord;
+        context.m_tnormal = normal;
+        context.m_tref    = index;
+        ++context.m_tstamp;
+        getPAxes(index, coord, normal, context.m_tpxaxis, context.m_tpyaxis);
     }
 
-    for (int i = 0; i < size; ++i)
+    for (int i = begin; i < end; ++i)
     {
-        if (i == 0)
-        {
-            inccs[i] = 0.0f;
-        } else if (!texs[i].empty())
-        {
-            if (robust == 0) inccs[i] = 1.0f - dot(texs[0], texs[i]);
-            else             inccs[i] = robustincc(1.0f - dot(texs[0], texs[i]));
-        } else
-        {
-            inccs[i] = 2.0f;
-        }
+        const int image = indexes[i];
+        if (context.m_tstamps[image] == context.m_tstamp) continue;
+
+        context.m_tstamps[image] = context.m_tstamp;
+        int failed;
+        if (m_fm.m_fixedPoint)
+            failed = grabTexFixed(coord, context.m_tpxaxis, context.m_tpyaxis, normal, image, context.m_tfixed.row(image).data(),
+                                  &context.m_tsums[3 * image], context.m_taves[image], context.m_tscales[image]);
+        else
+            failed = grabTex<W>(coord, context.m_tpxaxis, context.m_tpyaxis, normal, image,
+                                context.m_ttexs.row(image).data(), context.m_taves[image], context.m_tscales[image]);
+        if (failed) context.m_tscales[image] = 0.0f;
     }
 }
 
-void Coptim::setINCCs(const Patch::Cpatch& patch, std::vector<std::vector<float> >& inccs, const std::vector<int>& indexes, const int id, const int robust)
+void Coptim::setINCCs(const Patch::Cpatch& patch, std::vector<std::vector<float> >& inccs, const std::vector<int>& indexes, CoptimContext& context, const int robust)
 {
-    const int index = indexes[0];
-    Vec4f pxaxis, pyaxis;
-    getPAxes(index, patch.m_coord, patch.m_normal, pxaxis, pyaxis);
+    (this->*m_grabTexsW)(patch.m_coord, patch.m_normal, indexes, 0, (int)indexes.size(), context);
 
-    auto& texs = m_texsT[id];
+    const int size  = (int)indexes.size();
+    const int tsize = (int)context.m_ttexs.cols();
 
-    const int size = (int)indexes.size();
+    // Pack the normalized textures that could be grabbed, then all their nccs are T * T^t
+    std::vector<int>& rows = context.m_trows;
+    rows.resize(size);
+    int count = 0;
     for (int i = 0; i < size; ++i)
     {
-        const int flag = grabTex(patch.m_coord, pxaxis, pyaxis, patch.m_normal, indexes[i], m_fm.m_wsize, texs[i]);
+        const int image = indexes[i];
+        if (context.m_tscales[image] == 0.0f)
+        {
+            rows[i] = -1;
+            continue;
+        }
 
-        if (flag == 0) normalize(texs[i]);
+        rows[i] = count;
+        float* ntex = context.m_tnormalized.row(count++).data();
+        const float inv = 1.0f / context.m_tscales[image];
+        const Vec3f& ave = context.m_taves[image];
+        if (m_fm.m_fixedPoint)
+        {
+            // Planar, which does not matter for the dot products
+            const short* tex = context.m_tfixed.row(image).data();
+            const int num = tsize / 3;
+            const float finv = inv / (1 << FixedBits);
+            for (int c = 0; c < 3; ++c)
+            for (int k = 0; k < num; ++k)
+                ntex[c * num + k] = tex[c * m_fixedStride + k] * finv - ave[c] * inv;
+        } else
+        {
+            const float* tex = context.m_ttexs.row(image).data();
+            for (int k = 0; k < tsize; k += 3)
+            {
+                ntex[k]     = (tex[k]     - ave[0]) * inv;
+                ntex[k + 1] = (tex[k + 1] - ave[1]) * inv;
+                ntex[k + 2] = (tex[k + 2] - ave[2]) * inv;
+            }
+        }
     }
 
+    const auto packed = context.m_tnormalized.topRows(count);
+    context.m_tnccs.resize(count, count);
+    context.m_tnccs.noalias() = packed * packed.transpose();
+    context.m_tnccs /= (float)tsize;
+
     inccs.resize(size);
     for (int i = 0; i < size; ++i)
     inccs[i].resize(size);
@@ -827,10 +1613,11 @@ void Coptim::setINCCs(const Patch::Cpatch& patch, std::vector<std::vector<float>
         inccs[i][i] = 0.0f;
         for (int j = i+1; j < size; ++j)
         {
-            if (!texs[i].empty() && !texs[j].empty())
+            if (rows[i] != -1 && rows[j] != -1)
             {
-                if (robust == 0) inccs[j][i] = inccs[i][j] = 1.0f - dot(texs[i], texs[j]);
-                else             inccs[j][i] = inccs[i][j] = robustincc(1.0f - dot(texs[i], texs[j]));
+                const float ncc = context.m_tnccs(rows[i], rows[j]);
+                if (robust == 0) inccs[j][i] = inccs[i][j] = 1.0f - ncc;
+                else             inccs[j][i] = inccs[i][j] = robustincc(1.0f - ncc);
             } else
             {
                 inccs[j][i] = inccs[i][j] = 2.0f;
@@ -874,12 +1661,11 @@ float MyPow2(int x)
     return answers[x + 4];
 }
 
-static float Log2 = log(2.0f);
+static const float Log2 = log(2.0f);
 
-int Coptim::grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index, const int size, std::vector<float>& tex) const
+int Coptim::grabGrid(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index, const int size,
+                     Vec3f& left, Vec3f& dx, Vec3f& dy, int& level, float& scale) const
 {
-    tex.clear();
-
     Vec4f ray = m_fm.m_pss.m_photos[index].m_center - coord;
     unitize(ray);
     const float weight = std::max(0.0f, ray * pzaxis);
@@ -890,199 +1676,209 @@ int Coptim::grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis
     const int margin = size / 2;
 
     Vec3f center = m_fm.m_pss.project(index, coord, m_fm.m_level);
-    Vec3f dx     = m_fm.m_pss.project(index, coord + pxaxis, m_fm.m_level) - center;
-    Vec3f dy     = m_fm.m_pss.project(index, coord + pyaxis, m_fm.m_level) - center;
+    dx           = m_fm.m_pss.project(index, coord + pxaxis, m_fm.m_level) - center;
+    dy           = m_fm.m_pss.project(index, coord + pyaxis, m_fm.m_level) - center;
 
     const float ratio = (norm(dx) + norm(dy)) / 2.0f;
     int leveldif = (int)floor(log(ratio) / Log2 + 0.5f);
 
-    // Upper limit is 2
-    leveldif = std::max(-m_fm.m_level, std::min(2, leveldif));
+    // Upper limit is 2, and nothing finer than m_minLevel is loaded
+    leveldif = std::max(m_fm.m_minLevel - m_fm.m_level, std::min(2, leveldif));
 
-    const float scale = MyPow2(leveldif);
-    const int newlevel = m_fm.m_level + leveldif;
+    scale = MyPow2(leveldif);
+    level = m_fm.m_level + leveldif;
 
     center /= scale;  dx /= scale;  dy /= scale;
 
-    if (grabSafe(index, size, center, dx, dy, newlevel) == 0) return 1;
+    if (grabSafe(index, size, center, dx, dy, level) == 0) return 1;
 
-    Vec3f left = center - dx * margin - dy * margin;
-
-    tex.resize(3 * size * size);
-    float* texp = &tex[0] - 1;
-    for (int y = 0; y < size; ++y)
-    {
-        Vec3f vftmp = left;
-        left += dy;
-        for (int x = 0; x < size; ++x)
-        {
-            Vec3f color = m_fm.m_pss.getColor(index, vftmp[0], vftmp[1], newlevel);
-            *(++texp) = color[0];
-            *(++texp) = color[1];
-            *(++texp) = color[2];
-            vftmp += dx;
-        }
-    }
+    left = center - dx * margin - dy * margin;
 
     return 0;
 }
 
-double Coptim::computeINCC(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, const int id, const int robust)
+template<int W>
+int Coptim::grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index,
+                    float* const tex, Vec3f& ave, float& tscale) const
 {
-    if ((int)indexes.size() < 2) return 2.0;
+    const int size = W ? W : m_fm.m_wsize;
 
-    const int index = indexes[0];
-    Vec4f pxaxis, pyaxis;
-    getPAxes(index, coord, normal, pxaxis, pyaxis);
+    Vec3f left, dx, dy;
+    int level;
+    float scale;
+    if (grabGrid(coord, pxaxis, pyaxis, pzaxis, index, size, left, dx, dy, level, scale)) return 1;
+
+    const Image::SimageView view = m_fm.m_pss.m_photos[index].getView(level);
+    sampleTex<W>(view, left, dx, dy, size, tex, ave, tscale);
 
-    return computeINCC(coord, normal, indexes, pxaxis, pyaxis, id, robust);
+    return 0;
 }
 
-double Coptim::computeINCC(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, const Vec4f& pxaxis, const Vec4f& pyaxis, const int id, const int robust)
+template<int W>
+int Coptim::grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis,
+                    const Vec4f* const dcoord, const Vec4f* const dpxaxis, const Vec4f* const dpyaxis,
+                    const int index, float* const tex, float* const dtex, float& tscale) const
 {
-    if ((int)indexes.size() < 2) return 2.0;
+    const int size = W ? W : m_fm.m_wsize;
 
-    const int size = std::min(m_fm.m_tau, (int)indexes.size());
-    auto& texs = m_texsT[id];
+    Vec3f left, dx, dy;
+    int level;
+    float scale;
+    if (grabGrid(coord, pxaxis, pyaxis, pzaxis, index, size, left, dx, dy, level, scale)) return 1;
 
-    for (int i = 0; i < size; ++i)
+    // Derivatives of the sampling grid. The pyramid level is kept fixed.
+    const std::vector<Vec4f>& projection = m_fm.m_pss.m_photos[index].m_projection[m_fm.m_level];
+    Vec2f dcenter[3], ddx[3], ddy[3];
+    for (int p = 0; p < 3; ++p)
     {
-        int flag;
-        flag = grabTex(coord, pxaxis, pyaxis, normal,
-                        indexes[i], m_fm.m_wsize, texs[i]);
-
-        if (flag == 0) normalize(texs[i]);
+        dcenter[p] = projectD(projection, coord, dcoord[p]);
+        ddx[p]     = projectD(projection, coord + pxaxis, dcoord[p] + dpxaxis[p]) - dcenter[p];
+        ddy[p]     = projectD(projection, coord + pyaxis, dcoord[p] + dpyaxis[p]) - dcenter[p];
+        dcenter[p] /= scale;  ddx[p] /= scale;  ddy[p] /= scale;
     }
 
-    if (texs[0].empty()) return 2.0;
-
-    double score = 0.0;
-
-    float totalweight = 0.0f;
-    for (int i = 1; i < size; ++i)
-    {
-        if (!texs[i].empty())
-        {
-            totalweight += m_weightsT[id][i];
-            if (robust) score += robustincc(1.0f - dot(texs[0], texs[i])) * m_weightsT[id][i];
-            else        score += (1.0f - dot(texs[0], texs[i])) * m_weightsT[id][i];
-        }
-    }
+    const Image::SimageView view = m_fm.m_pss.m_photos[index].getView(level);
+    sampleTexD<W>(view, left, dx, dy, size, dcenter, ddx, ddy, tex, dtex);
 
-    if (totalweight == 0.0) score = 2.0;
-    else                    score /= totalweight;
+    tscale = normalizeTex(tex, size * size);
 
-    return score;
+    return 0;
 }
 
-// Normalize only scale for each image
-void Coptim::normalize(std::vector<std::vector<float>>& texs, const int size)
+int Coptim::grabTexFixed(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index,
+                         short* const tex, int* const sums, Vec3f& ave, float& tscale) const
 {
-    // Compute average rgb
-    Vec3f ave;
-    int denom = 0;
-
-    std::vector<Vec3f> rgbs;
-    rgbs.resize(size);
-    for (int i = 0; i < size; ++i)
-    {
-        if (texs[i].empty()) continue;
+    const int size = m_fm.m_wsize;
 
-        int count = 0;
-        while (count < (int)texs[i].size())
-        {
-            rgbs[i][0] += texs[i][count++];
-            rgbs[i][1] += texs[i][count++];
-            rgbs[i][2] += texs[i][count++];
-        }
+    Vec3f left, dx, dy;
+    int level;
+    float scale;
+    if (grabGrid(coord, pxaxis, pyaxis, pzaxis, index, size, left, dx, dy, level, scale)) return 1;
 
-        rgbs[i] /= (int)texs[i].size() / 3.0f;
+    const Image::SimageView view = m_fm.m_pss.m_photos[index].getView(level);
+    sampleTexFixed(view, left, dx, dy, size, m_fixedStride, tex, sums);
+    statsFixed(tex, sums, size * size, m_fixedStride, ave, tscale);
 
-        ave += rgbs[i];
-        ++denom;
-    }
+    return 0;
+}
 
-    // Overall average
-    if (denom == 0) return;
+float Coptim::textureZNCC(const CoptimContext& context, const int image0, const int image1) const
+{
+    if (m_fm.m_fixedPoint)
+        return computeZNCCFixed(context.m_tfixed.row(image0).data(), &context.m_tsums[3 * image0], context.m_tscales[image0],
+                                context.m_tfixed.row(image1).data(), &context.m_tsums[3 * image1], context.m_tscales[image1],
+                                m_fm.m_wsize * m_fm.m_wsize, m_fixedStride);
 
-    ave /= (float)denom;
+    return computeZNCC<0>(context.m_ttexs.row(image0).data(), context.m_taves[image0], context.m_tscales[image0],
+                          context.m_ttexs.row(image1).data(), context.m_taves[image1], context.m_tscales[image1], (int)context.m_ttexs.cols());
+}
 
-    // Scale all the colors
-    for (int i = 0; i < size; ++i)
+void Coptim::checkFixedPoint(void)
+{
+    const int size   = m_fm.m_wsize;
+    const int num    = size * size;
+    const int level  = m_fm.m_level;
+    const int margin = size + 4;
+
+    std::vector<float> tex0(3 * num), tex1(3 * num);
+    std::vector<short> ftex0(3 * m_fixedStride), ftex1(3 * m_fixedStride);
+    int sums0[3], sums1[3];
+
+    // Windows on a lattice of each image, compared with a rotated and scaled window nearby in the same image
+    float maxError = 0.0f;
+    int count = 0;
+    int compared = 0;
+    for (int index = 0; index < m_fm.m_num; ++index)
     {
-        if (texs[i].empty()) continue;
-        int count = 0;
-        // Compute scale
-        Vec3f scale;
-        for (int j = 0; j < 3; ++j) if (rgbs[i][j] != 0.0f) scale[j] = ave[j] / rgbs[i][j];
-
-        while (count < (int)texs[i].size())
+        m_fm.m_pss.pin(index);
+        const Image::SimageView view = m_fm.m_pss.m_photos[index].getView(level);
+        const int width  = view.m_width;
+        const int height = view.m_height;
+
+        const int step = std::max(1, std::min(width, height) / 8);
+        for (int y = 2 * margin; y < height - 2 * margin; y += step)
+        for (int x = 2 * margin; x < width - 2 * margin; x += step)
         {
-            texs[i][count++] *= scale[0];
-            texs[i][count++] *= scale[1];
-            texs[i][count++] *= scale[2];
+            const float angle = 0.3f * (float)(count % 7);
+            const float unit  = 0.8f + 0.05f * (float)(count % 5);
+            const Vec3f dx0(1.0f, 0.0f, 0.0f), dy0(0.0f, 1.0f, 0.0f);
+            const Vec3f dx1(unit * cos(angle), unit * sin(angle), 0.0f), dy1(-unit * sin(angle), unit * cos(angle), 0.0f);
+            const Vec3f left0((float)x + 0.25f, (float)y + 0.5f, 0.0f);
+            const Vec3f left1 = left0 + Vec3f(0.37f, 0.71f, 0.0f) - dx1 * 1.5f - dy1 * 1.5f;
+            ++count;
+
+            Vec3f ave0, ave1, fave0, fave1;
+            float scale0, scale1, fscale0, fscale1;
+            sampleTex<0>(view, left0, dx0, dy0, size, &tex0[0], ave0, scale0);
+            sampleTex<0>(view, left1, dx1, dy1, size, &tex1[0], ave1, scale1);
+            sampleTexFixed(view, left0, dx0, dy0, size, m_fixedStride, &ftex0[0], sums0);
+            sampleTexFixed(view, left1, dx1, dy1, size, m_fixedStride, &ftex1[0], sums1);
+            statsFixed(&ftex0[0], sums0, num, m_fixedStride, fave0, fscale0);
+            statsFixed(&ftex1[0], sums1, num, m_fixedStride, fave1, fscale1);
+
+            // Flat windows have no meaningful ncc
+            if (scale0 < 1.0f || scale1 < 1.0f) continue;
+
+            const float ncc  = computeZNCC<0>(&tex0[0], ave0, scale0, &tex1[0], ave1, scale1, 3 * num);
+            const float fncc = computeZNCCFixed(&ftex0[0], sums0, fscale0, &ftex1[0], sums1, fscale1, num, m_fixedStride);
+            maxError = std::max(maxError, std::fabs(ncc - fncc));
+            ++compared;
         }
+        m_fm.m_pss.unpin(index);
     }
+
+    std::cerr << "Fixed point check: max ncc error " << maxError << " over " << compared << " windows";
+    if (0.01f < maxError)
+    {
+        std::cerr << ", using float textures";
+        m_fm.m_fixedPoint = 0;
+    }
+    std::cerr << std::endl;
 }
 
-void Coptim::normalize(std::vector<float>& tex)
+double Coptim::computeINCC(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, CoptimContext& context, const int robust)
 {
-    const int size = (int)tex.size();
-    const int size3 = size / 3;
-    Vec3f ave;
+    return (this->*m_computeINCCW)(coord, normal, indexes, context, robust);
+}
 
-    float* texp = &tex[0] - 1;
-    for (int i = 0; i < size3; ++i)
-    {
-        ave[0] += *(++texp);
-        ave[1] += *(++texp);
-        ave[2] += *(++texp);
-    }
+template<int W>
+double Coptim::computeINCCW(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, CoptimContext& context, const int robust)
+{
+    if ((int)indexes.size() < 2) return 2.0;
 
-    ave /= (float)size3;
+    const int size = std::min(m_fm.m_tau, (int)indexes.size());
 
-    float ave2 = 0.0;
-    texp = &tex[0] - 1;
-    for (int i = 0; i < size3; ++i)
-    {
-        const float f0 = ave[0] - *(++texp);
-        const float f1 = ave[1] - *(++texp);
-        const float f2 = ave[2] - *(++texp);
+    // Through the texture cache, so that the score of a refined patch shares its grabs with postProcess
+    grabTexsW<W>(coord, normal, indexes, 0, size, context);
 
-        ave2 += f0 * f0 + f1 * f1 + f2 * f2;
-    }
+    const int index = indexes[0];
+    const float scale0 = context.m_tscales[index];
+    if (scale0 == 0.0f) return 2.0;
 
-    ave2 = sqrt(ave2 / size);
+    const float* const tex0 = context.m_ttexs.row(index).data();
+    const Vec3f& ave0 = context.m_taves[index];
+    const int tsize = (int)context.m_ttexs.cols();
 
-    if (ave2 == 0.0f) ave2 = 1.0f;
+    double score = 0.0;
 
-    texp = &tex[0] - 1;
-    for (int i = 0; i < size3; ++i)
+    float totalweight = 0.0f;
+    for (int i = 1; i < size; ++i)
     {
-        *(++texp) -= ave[0];    *texp /= ave2;
-        *(++texp) -= ave[1];    *texp /= ave2;
-        *(++texp) -= ave[2];    *texp /= ave2;
+        const int image = indexes[i];
+        if (context.m_tscales[image] != 0.0f)
+        {
+            totalweight += context.m_weights[i];
+            const float ncc = m_fm.m_fixedPoint ? textureZNCC(context, index, image)
+                                                : computeZNCC<W>(tex0, ave0, scale0, context.m_ttexs.row(image).data(), context.m_taves[image], context.m_tscales[image], tsize);
+            if (robust) score += robustincc(1.0f - ncc) * context.m_weights[i];
+            else        score += (1.0f - ncc) * context.m_weights[i];
+        }
     }
-}
 
-float Coptim::dot(const std::vector<float>& tex0, const std::vector<float>& tex1) const
-{
-#ifndef PMVS_WNCC
-    // Pierre Moulon (use classic access to array, windows STL do not like begin()-1)
-    const int size = (int)tex0.size();
-    float ans = 0.0f;
-    for (int i = 0; i < size; ++i) ans += tex0[i] * tex1[i];
-
-    return ans / size;
-#else
-    const int size = (int)tex0.size();
-    auto i0 = tex0.begin();
-    auto i1 = tex1.begin();
-    float ans = 0.0f;
-    for (int i = 0; i < size; ++i, ++i0, ++i1) ans += (*i0) * (*i1) * m_template[i];
+    if (totalweight == 0.0) score = 2.0;
+    else                    score /= totalweight;
 
-    return ans;
-#endif
+    return score;
 }
 
 float Coptim::getUnit(const int index, const Vec4f& coord) const
@@ -1109,15 +1905,69 @@ void Coptim::getPAxes(const int index, const Vec4f& coord, const Vec4f& normal,
 
     pxaxis *= pscale;
     pyaxis *= pscale;
-    const float xdis = norm(m_fm.m_pss.project(index, coord + pxaxis, m_fm.m_level) - m_fm.m_pss.project(index, coord, m_fm.m_level));
-    const float ydis = norm(m_fm.m_pss.project(index, coord + pyaxis, m_fm.m_level) - m_fm.m_pss.project(index, coord, m_fm.m_level));
+    const Vec3f center = m_fm.m_pss.project(index, coord, m_fm.m_level);
+    const float xdis = norm(m_fm.m_pss.project(index, coord + pxaxis, m_fm.m_level) - center);
+    const float ydis = norm(m_fm.m_pss.project(index, coord + pyaxis, m_fm.m_level) - center);
     pxaxis /= xdis;
     pyaxis /= ydis;
 }
 
-void Coptim::setWeightsT(const Patch::Cpatch& patch, const int id)
+void Coptim::getPAxes(const int index, const Vec4f& coord, const Vec4f& normal, const Vec4f* const dcoord, const Vec4f* const dnormal,
+                      Vec4f& pxaxis, Vec4f& pyaxis, Vec4f* const dpxaxis, Vec4f* const dpyaxis) const
+{
+    // Same as getPAxes above, differentiated along the way
+    const float fz = norm(coord - m_fm.m_pss.m_photos[index].m_center);
+    const float pscale = getUnit(index, coord);
+    Vec4f dpscale;
+    if (m_ipscales[index] != 0.0f && fz != 0.0f) dpscale = (coord - m_fm.m_pss.m_photos[index].m_center) * (pscale / (fz * fz));
+
+    const Vec3f normal3(normal[0], normal[1], normal[2]);
+    Vec3f yaxis3 = cross(normal3, m_xaxes[index]);
+    const float ylength = norm(yaxis3);
+    yaxis3 /= ylength;
+    const Vec3f xaxis3 = cross(yaxis3, normal3);
+
+    const Vec4f xaxis(xaxis3[0], xaxis3[1], xaxis3[2], 0.0f);
+    const Vec4f yaxis(yaxis3[0], yaxis3[1], yaxis3[2], 0.0f);
+
+    const Vec4f qx = xaxis * pscale;
+    const Vec4f qy = yaxis * pscale;
+
+    const std::vector<Vec4f>& projection = m_fm.m_pss.m_photos[index].m_projection[m_fm.m_level];
+    const Vec3f icoord = m_fm.m_pss.project(index, coord, m_fm.m_level);
+    const Vec3f ex3 = m_fm.m_pss.project(index, coord + qx, m_fm.m_level) - icoord;
+    const Vec3f ey3 = m_fm.m_pss.project(index, coord + qy, m_fm.m_level) - icoord;
+    const Vec2f ex(ex3[0], ex3[1]);
+    const Vec2f ey(ey3[0], ey3[1]);
+    const float xdis = norm(ex);
+    const float ydis = norm(ey);
+
+    pxaxis = qx / xdis;
+    pyaxis = qy / ydis;
+
+    for (int p = 0; p < 3; ++p)
+    {
+        const Vec3f dnormal3(dnormal[p][0], dnormal[p][1], dnormal[p][2]);
+        Vec3f dyaxis3 = cross(dnormal3, m_xaxes[index]) / ylength;
+        dyaxis3 -= yaxis3 * (yaxis3 * dyaxis3);
+        const Vec3f dxaxis3 = cross(dyaxis3, normal3) + cross(yaxis3, dnormal3);
+
+        const float ds = dpscale * dcoord[p];
+        const Vec4f dqx = xaxis * ds + Vec4f(dxaxis3[0], dxaxis3[1], dxaxis3[2], 0.0f) * pscale;
+        const Vec4f dqy = yaxis * ds + Vec4f(dyaxis3[0], dyaxis3[1], dyaxis3[2], 0.0f) * pscale;
+
+        const Vec2f dicoord = projectD(projection, coord, dcoord[p]);
+        const float dxdis = ex * (projectD(projection, coord + qx, dcoord[p] + dqx) - dicoord) / xdis;
+        const float dydis = ey * (projectD(projection, coord + qy, dcoord[p] + dqy) - dicoord) / ydis;
+
+        dpxaxis[p] = dqx / xdis - pxaxis * (dxdis / xdis);
+        dpyaxis[p] = dqy / ydis - pyaxis * (dydis / ydis);
+    }
+}
+
+void Coptim::setWeights(const Patch::Cpatch& patch, CoptimContext& context)
 {
-    computeUnits(patch, m_weightsT[id]);
-    for (auto& weight : m_weightsT[id]) weight = std::min(1.0f, m_weightsT[id][0] / weight);  
-    m_weightsT[id][0] = 1.0f;
+    computeUnits(patch, context.m_weights);
+    for (auto& weight : context.m_weights) weight = std::min(1.0f, context.m_weights[0] / weight);  
+    context.m_weights[0] = 1.0f;
 }
@@ -4,22 +4,75 @@
 
 #include "patch.h"
 
-#include "unsupported/Eigen/NonLinearOptimization"
+#include <Eigen/Dense>
 
 namespace PMVS3
 {
 
 class CfindMatch;
 
+// State of Coptim while refining or evaluating one patch. Each worker thread owns its own context,
+// aligned so that the contexts of two workers never share a cache line.
+class alignas(64) CoptimContext
+{
+public:
+    Vec4f m_center;                 // Patch center before refinement
+    Vec4f m_ray;                    // Viewing ray of the reference image through m_center
+    std::vector<int> m_indexes;     // Images of the patch
+    float m_dscale;                 // Unit of the depth parameter
+    float m_ascale;                 // Unit of the angle parameters
+
+    std::vector<std::vector<float>> m_texs;     // Textures of the generic kernels
+    std::vector<std::vector<float>> m_dtexs;    // Derivatives of m_texs w.r.t. the three patch parameters
+    std::vector<float>              m_weights;  // weights for refineDepthOrientationWeighed
+
+    // Textures grabbed by grabTexsW, kept while the patch and its reference image stay the same so that
+    // constraintImages and setRefImage do not sample them again. Rows are indexed by image.
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Textures;
+    Textures            m_ttexs;        // Raw textures
+    std::vector<Vec3f>  m_taves;        // Mean colors of m_ttexs
+    std::vector<float>  m_tscales;      // Scales of m_ttexs, 0 if the texture could not be grabbed
+    std::vector<int>    m_tstamps;      // A texture is valid if its stamp is m_tstamp
+    int                 m_tstamp;
+    Vec4f               m_tcoord;       // Patch and reference image of the valid textures
+    Vec4f               m_tnormal;
+    int                 m_tref;
+    Vec4f               m_tpxaxis;      // Axes of the patch in the reference image
+    Vec4f               m_tpyaxis;
+
+    // Used instead of m_ttexs when m_fixedPoint is set: colors times 16, one plane per channel padded with zeros
+    typedef Eigen::Matrix<short, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> FixedTextures;
+    FixedTextures       m_tfixed;
+    std::vector<int>    m_tsums;        // Sums of the planes of m_tfixed, three per image
+
+    Textures            m_tnormalized;  // Normalized textures packed for the pairwise nccs
+    Eigen::MatrixXf     m_tnccs;
+    std::vector<int>    m_trows;
+
+    std::vector<int>    m_cascadeTrials;    // Candidates checked at each cascade stage
+    std::vector<int>    m_cascadeRejects;   // Candidates rejected at each cascade stage
+
+    std::vector<int>    m_pinned;           // Images pinned by the worker's current job
+    std::vector<char>   m_isPinned;
+};
+
 class Coptim
 {
 public:
     Coptim(CfindMatch& findMatch);
 
     void init(void);
+    // Sizes the buffers of a worker's context
+    void initContext(CoptimContext& context) const;
+
+    // Keep images loaded for the current job of a worker when m_pss has a memory budget. Every image whose
+    // textures are grabbed has to be pinned. addImages pins the images it adds.
+    void pinImage(const int image, CoptimContext& context) const;
+    void pinImages(const std::vector<int>& images, CoptimContext& context) const;
+    void unpinImages(CoptimContext& context) const;
 
     void collectImages(const int index, std::vector<int>& indexes) const;
-    void addImages(Patch::Cpatch& patch) const;
+    void addImages(Patch::Cpatch& patch, CoptimContext& context) const;
     void removeImagesEdge(Patch::Cpatch& patch) const;
 
     float getUnit(const int index, const Vec4f& coord) const;
@@ -27,76 +80,106 @@ public:
     void computeUnits(const Patch::Cpatch& patch, std::vector<int>& indexes, std::vector<float>& fineness, std::vector<Vec4f>& rays) const;
     void computeUnits(const Patch::Cpatch& patch, std::vector<float>& fineness) const;
 
-    int preProcess(Patch::Cpatch& patch, const int id, const int seed);
-    int postProcess(Patch::Cpatch& patch, const int id, const int seed);
+    int preProcess(Patch::Cpatch& patch, CoptimContext& context, const int seed);
+    int postProcess(Patch::Cpatch& patch, CoptimContext& context, const int seed);
 
-    bool refinePatchBFGS(Patch::Cpatch& patch, const int id);
+    bool refinePatchBFGS(Patch::Cpatch& patch, CoptimContext& context);
 
-    void setRefImage(Patch::Cpatch& patch, const int id);
+    void setRefImage(Patch::Cpatch& patch, CoptimContext& context);
 
     int check(Patch::Cpatch& patch);
 
+    // Cascade statistics of a run, merged from the workers' contexts under m_fm.m_lock
+    void clearCascadeCounts(void);
+    void addCascadeCounts(const CoptimContext& context);
+    void printCascadeCounts(void) const;
+
     std::vector<int> m_status;
 
 protected:
     void filterImagesByAngle(Patch::Cpatch& patch);
 
     void sortImages(Patch::Cpatch& patch) const;
-    void constraintImages(Patch::Cpatch& patch, const float nccThreshold, const int id);
-
-    void setINCCs(const Patch::Cpatch& patch, std::vector<float> & nccs, const std::vector<int>& indexes, const int id, const int robust);
-    void setINCCs(const Patch::Cpatch& patch, std::vector<std::vector<float>>& nccs, const std::vector<int>& indexes, const int id, const int robust);
-
-    int grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index, const int size, std::vector<float>& tex) const;
+    void constraintImages(Patch::Cpatch& patch, const float nccThreshold, CoptimContext& context);
+
+    // Rejects hopeless candidates before refinement by checking photo-consistency at coarser levels with a smaller window
+    int checkCascade(const Patch::Cpatch& patch, CoptimContext& context);
+
+    void setINCCs(const Patch::Cpatch& patch, std::vector<std::vector<float>>& nccs, const std::vector<int>& indexes, CoptimContext& context, const int robust);
+
+    // Sampling grid of a texture in an image: the first sample, the steps along x and y and the pyramid level.
+    // Returns 1 when the texture cannot be grabbed.
+    int grabGrid(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index, const int size,
+                 Vec3f& left, Vec3f& dx, Vec3f& dy, int& level, float& scale) const;
+    // Grabs the raw texture together with its mean color and scale
+    template<int W> int grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index,
+                                float* const tex, Vec3f& ave, float& tscale) const;
+    // Grabs the normalized texture and the derivatives of the raw one w.r.t. the three patch parameters
+    template<int W> int grabTex(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis,
+                                const Vec4f* const dcoord, const Vec4f* const dpxaxis, const Vec4f* const dpyaxis,
+                                const int index, float* const tex, float* const dtex, float& tscale) const;
+    // Fixed point counterpart of the first grabTex, also returns the sums of the three planes
+    int grabTexFixed(const Vec4f& coord, const Vec4f& pxaxis, const Vec4f& pyaxis, const Vec4f& pzaxis, const int index,
+                     short* const tex, int* const sums, Vec3f& ave, float& tscale) const;
+    // ncc of the textures of two images cached in the context
+    float textureZNCC(const CoptimContext& context, const int image0, const int image1) const;
+    // Compares fixed point nccs with float ones on a lattice of windows, and goes back to float if they differ
+    void checkFixedPoint(void);
     int grabSafe(const int index, const int size, const Vec3f& center, const Vec3f& dx, const Vec3f& dy, const int level) const;
 
-    double computeINCC(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, const Vec4f& pxaxis, const Vec4f& pyaxis, const int id, const int robust);
-
-public:
-    static void normalize(std::vector<float>& tex);
-    static void normalize(std::vector<std::vector<float>>& texs, const int size);
+    // Moves the depth of vect along the reference ray to the best of a few samples, keeping the normal.
+    // Returns the robust ncc cost at that depth.
+    double searchDepth(double* const vect, CoptimContext& context);
 
-    float dot(const std::vector<float>& tex0, const std::vector<float>& tex1) const;
+    // Robust ncc cost of the patch encoded in vect, also sets the Gauss-Newton system of the cost
+    double evaluateGN(const double* const vect, Eigen::Matrix3d& H, Eigen::Vector3d& g, CoptimContext& context);
 
-    //BFGS
-    static void my_f_lm(const Eigen::VectorXd &par, Eigen::VectorXd &fvec, int id);
-    static void my_f_lm(const Eigen::VectorXf &par, Eigen::VectorXf &fvec, int id);
+    // Kernels specialized on the window size W, or generic for W = 0. The ones used are chosen in init.
+    template<int W> void setKernels(void);
+    // Grabs the textures of indexes[begin] to indexes[end - 1] for the patch into the context, with the axes of the
+    // reference image indexes[0]
+    template<int W> void grabTexsW(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, const int begin, const int end,
+                                   CoptimContext& context);
+    template<int W> double computeINCCW(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, CoptimContext& context, const int robust);
+    template<int W> double evaluateGNW(const double* const vect, Eigen::Matrix3d& H, Eigen::Vector3d& g, CoptimContext& context);
 
-    void encode(const Vec4f& coord, double* const vect, const int id) const;
-    void encode(const Vec4f& coord, const Vec4f& normal, double* const vect, const int id) const;
-    void decode(Vec4f& coord, Vec4f& normal, const double* const vect, const int id) const;
-    void decode(Vec4f& coord, const double* const vect, const int id) const;
+public:
+    void encode(const Vec4f& coord, double* const vect, const CoptimContext& context) const;
+    void encode(const Vec4f& coord, const Vec4f& normal, double* const vect, const CoptimContext& context) const;
+    void decode(Vec4f& coord, Vec4f& normal, const double* const vect, const CoptimContext& context) const;
+    void decode(Vec4f& coord, const double* const vect, const CoptimContext& context) const;
+    // Also returns the derivatives of coord and normal w.r.t. the three parameters
+    void decode(Vec4f& coord, Vec4f& normal, Vec4f* const dcoord, Vec4f* const dnormal, const double* const vect, const CoptimContext& context) const;
 
-    void setWeightsT(const Patch::Cpatch& patch, const int id);
+    void setWeights(const Patch::Cpatch& patch, CoptimContext& context);
 
     void getPAxes(const int index, const Vec4f& coord, const Vec4f& normal, Vec4f& pxaxis, Vec4f& pyaxis) const;
+    void getPAxes(const int index, const Vec4f& coord, const Vec4f& normal, const Vec4f* const dcoord, const Vec4f* const dnormal,
+                  Vec4f& pxaxis, Vec4f& pyaxis, Vec4f* const dpxaxis, Vec4f* const dpyaxis) const;
 
-    double computeINCC(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, const int id, const int robust);
+    double computeINCC(const Vec4f& coord, const Vec4f& normal, const std::vector<int>& indexes, CoptimContext& context, const int robust);
     static inline float robustincc(const float rhs) { return rhs / (1 + 3 * rhs); }
     static inline float unrobustincc(const float rhs) { return rhs / (1 - 3 * rhs); }
 
 protected:
     void setAxesScales(void);
 
-    static Coptim* m_one;
     CfindMatch& m_fm;
 
+    // Window size kernels chosen in init
+    void (Coptim::*m_grabTexsW)(const Vec4f&, const Vec4f&, const std::vector<int>&, const int, const int, CoptimContext&);
+    double (Coptim::*m_computeINCCW)(const Vec4f&, const Vec4f&, const std::vector<int>&, CoptimContext&, const int);
+    double (Coptim::*m_evaluateGNW)(const double* const, Eigen::Matrix3d&, Eigen::Vector3d&, CoptimContext&);
+
     std::vector<Vec3f> m_xaxes;
     std::vector<Vec3f> m_yaxes;
     std::vector<Vec3f> m_zaxes;
     std::vector<float> m_ipscales;
 
-    std::vector<float> m_vect0T;  
-    std::vector<Vec4f> m_centersT;
-    std::vector<Vec4f> m_raysT;
-    std::vector<std::vector<int>> m_indexesT;
-    std::vector<float> m_dscalesT;
-    std::vector<float> m_ascalesT;
-
-    std::vector<Vec3f>                              m_paramsT;      // stores current parameters for derivative computation
-    std::vector<std::vector<std::vector<float>>>    m_texsT;        // Grabbed texture, last is 7x7x3 patch
-    std::vector<std::vector<float>>                 m_weightsT;     // weights for refineDepthOrientationWeighed
-    std::vector<std::vector<double>>                m_worksT;       // Working array for levmar
+    int m_fixedStride;      // Samples per plane of a fixed point texture
+
+    std::vector<int> m_cascadeTrials;
+    std::vector<int> m_cascadeRejects;
 };
 
 };
\ No newline at end of file
@@ -27,6 +27,18 @@ Soption::Soption(void)
     m_maxAngleThreshold = 10.0f * M_PI / 180.0f;
     // The smaller the tighter
     m_quadThreshold = 2.5f;
+
+    m_cascade = 0;
+    m_cascadeWsize = 5;
+    m_cascadeThreshold = 0.3f;
+    m_depthSearch = 0;
+    m_fixedPoint = 0;
+    m_minLevel = 0;
+    m_pyramidCache = 0;
+    m_imageBudget = 0;
+    m_imageLayout = 0;
+    m_grayFeatures = 0;
+    m_featureCache = 0;
 }
 
 void Soption::init(const std::string prefix, const std::string option)
@@ -99,6 +111,17 @@ void Soption::init(const std::string prefix, const std::string option)
                 std::cerr << "oflag is not valid: " << m_oflag << std::endl;   exit (1);
             }
         } else if (name == "quad")      ifstr >> m_quadThreshold;
+        else if (name == "cascade")             ifstr >> m_cascade;
+        else if (name == "cascadeWsize")        ifstr >> m_cascadeWsize;
+        else if (name == "cascadeThreshold")    ifstr >> m_cascadeThreshold;
+        else if (name == "depthSearch")         ifstr >> m_depthSearch;
+        else if (name == "fixedPoint")          ifstr >> m_fixedPoint;
+        else if (name == "minLevel")            ifstr >> m_minLevel;
+        else if (name == "pyramidCache")        ifstr >> m_pyramidCache;
+        else if (name == "imageBudget")         ifstr >> m_imageBudget;
+        else if (name == "imageLayout")         ifstr >> m_imageLayout;
+        else if (name == "grayFeatures")        ifstr >> m_grayFeatures;
+        else if (name == "featureCache")        ifstr >> m_featureCache;
         else if (name == "maxAngle")
         {
             ifstr >> m_maxAngleThreshold;
@@ -142,6 +165,14 @@ void Soption::init(const std::string prefix, const std::string option)
               << "threshold: " << m_threshold << "  wsize: " << m_wsize << std::endl
               << "minImageNum: " << m_minImageNum << "  CPU: " << m_CPU << std::endl
               << "useVisData: " << m_useVisData << "  sequence: " << m_sequence << std::endl;
+    if (m_cascade)
+        std::cerr << "cascade: " << m_cascade << "  cascadeWsize: " << m_cascadeWsize
+                  << "  cascadeThreshold: " << m_cascadeThreshold << std::endl;
+    if (m_depthSearch || m_fixedPoint || m_minLevel || m_pyramidCache || m_imageBudget || m_imageLayout || m_grayFeatures || m_featureCache)
+        std::cerr << "depthSearch: " << m_depthSearch << "  fixedPoint: " << m_fixedPoint
+                  << "  minLevel: " << m_minLevel << "  pyramidCache: " << m_pyramidCache
+                  << "  imageBudget: " << m_imageBudget << "  imageLayout: " << m_imageLayout
+                  << "  grayFeatures: " << m_grayFeatures << "  featureCache: " << m_featureCache << std::endl;
     std::cerr << "--------------------------------------------------" << std::endl;
 }
 
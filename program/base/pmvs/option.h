@@ -26,6 +26,18 @@ public:
     float m_maxAngleThreshold;
     float m_quadThreshold;
 
+    int   m_cascade;            // Number of coarse levels checked before refinement, 0 disables the cascade
+    int   m_cascadeWsize;       // Window size of the cascade
+    float m_cascadeThreshold;   // ncc threshold of the cascade
+    int   m_depthSearch;        // Search the depth along the reference ray before the full refinement
+    int   m_fixedPoint;         // Sample textures and compute their nccs in fixed point
+    int   m_minLevel;           // Finest pyramid level loaded, at most level
+    int   m_pyramidCache;       // Keep the image pyramids in visualize/*.pyr across runs
+    int   m_imageBudget;        // Megabytes of images kept loaded, 0 loads all of them
+    int   m_imageLayout;        // 1: the texture kernels read tiled copies of the image levels
+    int   m_grayFeatures;       // Detect features on the luminance instead of the colors
+    int   m_featureCache;       // Keep the detected features in visualize/*.ftr across runs
+
     std::string m_prefix;
     std::string m_option;
     std::vector<int> m_timages;
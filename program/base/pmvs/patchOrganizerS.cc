@@ -633,6 +633,27 @@ void CpatchOrganizerS::setScales(Patch::Cpatch& patch) const
     patch.m_ascale = atan(patch.m_dscale / (unit * m_fm.m_wsize / 2.0f));
 }
 
+void CpatchOrganizerS::residentOrder(const std::vector<Ppatch>& ppatches, std::vector<int>& order) const
+{
+    order.resize(ppatches.size());
+    if (m_fm.m_pss.m_budget == 0)
+    {
+        for (int p = 0; p < (int)ppatches.size(); ++p) order[p] = p;
+        return;
+    }
+
+    // Sorted by their sets of images
+    std::vector<std::pair<std::vector<int>, int>> keys(ppatches.size());
+    for (int p = 0; p < (int)ppatches.size(); ++p)
+    {
+        keys[p].first = ppatches[p]->m_images;
+        std::sort(keys[p].first.begin(), keys[p].first.end());
+        keys[p].second = p;
+    }
+    std::sort(keys.begin(), keys.end());
+    for (int p = 0; p < (int)ppatches.size(); ++p) order[p] = keys[p].second;
+}
+
 void CpatchOrganizerS::writePLY(const std::vector<Ppatch>& patches, const std::string filename)
 {
     std::ofstream ofstr;
@@ -651,6 +672,25 @@ void CpatchOrganizerS::writePLY(const std::vector<Ppatch>& patches, const std::s
           << "property uchar diffuse_blue" << std::endl
           << "end_header" << std::endl;
 
+    // Mean colors in the images. Patches are visited in residentOrder, and the images of the previous patch are
+    // released once the ones of the next patch are pinned, so that images stay loaded under a memory budget.
+    std::vector<Vec3f> colorfs(patches.size());
+    std::vector<int> order;
+    residentOrder(patches, order);
+    std::vector<int> pinned;
+    for (int o = 0; o < (int)order.size(); ++o)
+    {
+        const Cpatch& patch = *patches[order[o]];
+        m_fm.m_pss.pin(patch.m_images);
+        m_fm.m_pss.unpin(pinned);
+        pinned = patch.m_images;
+
+        for (int i = 0; i < (int)patch.m_images.size(); ++i)
+            colorfs[order[o]] += m_fm.m_pss.getColor(patch.m_coord, patch.m_images[i], m_fm.m_level);
+        colorfs[order[o]] /= static_cast<float>(patch.m_images.size());
+    }
+    m_fm.m_pss.unpin(pinned);
+
     auto bpatch = patches.cbegin();
     auto bend = patches.cend();
 
@@ -665,16 +705,7 @@ void CpatchOrganizerS::writePLY(const std::vector<Ppatch>& patches, const std::s
         // 2: angle
         if (mode == 0)
         {
-            int denom = 0;
-            Vec3f colorf;
-            for (int i = 0; i < (int)(*bpatch)->m_images.size(); ++i)
-            {
-                const int image = (*bpatch)->m_images[i];
-                colorf += m_fm.m_pss.getColor((*bpatch)->m_coord, image, m_fm.m_level);
-                denom++;
-            }
-
-            colorf /= static_cast<float>(denom);
+            const Vec3f& colorf = colorfs[bpatch - patches.cbegin()];
             color[0] = std::min(255,(int)floor(colorf[0] + 0.5f));
             color[1] = std::min(255,(int)floor(colorf[1] + 0.5f));
             color[2] = std::min(255,(int)floor(colorf[2] + 0.5f));
@@ -30,6 +30,10 @@ public:
 
     void writePLY(const std::vector<Patch::Ppatch>& patches, const std::string filename);
 
+    // Order of a serial pass over the patches that keeps patches with the same images next to each other, so that
+    // their images stay loaded under a memory budget. Without a budget, the patches are kept in order.
+    void residentOrder(const std::vector<Patch::Ppatch>& ppatches, std::vector<int>& order) const;
+
     void clearCounts(void);
     void clearFlags(void);
 
@@ -27,6 +27,48 @@ void Cseed::init(const std::vector<std::vector<Cpoint> >& points)
     }
 
     readPoints(points);
+
+    // Image pairs matched by the seeds do not change, so their fundamental matrices are set once
+    m_indexes.clear();
+    m_indexes.resize(m_fm.m_tnum);
+    m_fundamentals.clear();
+    m_fundamentals.resize(m_fm.m_tnum);
+    m_tfundamentals.clear();
+    m_tfundamentals.resize(m_fm.m_tnum);
+
+    m_fm.m_jobs.clear();
+    for (int index = 0; index < m_fm.m_tnum; ++index) m_fm.m_jobs.push_back(index);
+
+    std::vector<std::thread> threads(m_fm.m_CPU);
+    for (auto& t : threads) t = std::thread(&Cseed::initFundamentalThread, this);
+    for (auto& t : threads) t.join();
+}
+
+void Cseed::initFundamentalThread(void)
+{
+    while (1)
+    {
+        int index = -1;
+        m_fm.m_lock.lock();
+        if (!m_fm.m_jobs.empty())
+        {
+            index = m_fm.m_jobs.front();
+            m_fm.m_jobs.pop_front();
+        }
+        m_fm.m_lock.unlock();
+        if (index == -1) break;
+
+        m_fm.m_optim.collectImages(index, m_indexes[index]);
+
+        const int size = (int)m_indexes[index].size();
+        m_fundamentals[index].resize(size);
+        m_tfundamentals[index].resize(size);
+        for (int i = 0; i < size; ++i)
+        {
+            Image::setF(m_fm.m_pss.m_photos[index], m_fm.m_pss.m_photos[m_indexes[index][i]], m_fundamentals[index][i], m_fm.m_level);
+            m_tfundamentals[index][i] = transpose(m_fundamentals[index][i]);
+        }
+    }
 }
 
 void Cseed::readPoints(const std::vector<std::vector<Cpoint> >& points)
@@ -82,6 +124,8 @@ void Cseed::run(void)
     time(&tv);
     time_t curtime = tv;
 
+    m_fm.m_optim.clearCascadeCounts();
+
     std::vector<std::thread> threads(m_fm.m_CPU);
     for (auto& t : threads) t = std::thread(&Cseed::initialMatchThread, this);
     for (auto& t : threads) t.join();
@@ -103,6 +147,7 @@ void Cseed::run(void)
               << 100 * fail0 / (float)trial << ' '
               << 100 * fail1 / (float)trial << ' '
               << 100 * (pass + fail1) / (float)trial << std::endl;
+    m_fm.m_optim.printCascadeCounts();
 }
 
 void Cseed::initialMatchThread(void)
@@ -111,6 +156,9 @@ void Cseed::initialMatchThread(void)
     const int id = m_fm.m_count++;
     m_fm.m_lock.unlock();
 
+    CoptimContext context;
+    m_fm.m_optim.initContext(context);
+
     while (1)
     {
         int index = -1;
@@ -123,23 +171,28 @@ void Cseed::initialMatchThread(void)
         m_fm.m_lock.unlock();
         if (index == -1) break;
 
-        initialMatch(index, id);
+        // Loads the image and its neighbors before matching
+        m_fm.m_optim.pinImage(index, context);
+        m_fm.m_optim.pinImages(m_fm.m_visdata2[index], context);
+        initialMatch(index, id, context);
+        m_fm.m_optim.unpinImages(context);
     }
+
+    std::lock_guard<std::mutex> lock(m_fm.m_lock);
+    m_fm.m_optim.addCascadeCounts(context);
 }
 
 void Cseed::clear(void)
 {
     std::vector<std::vector<std::vector<Ppoint> > >().swap(m_ppoints);
+    std::vector<std::vector<int>>().swap(m_indexes);
+    std::vector<std::vector<Mat3>>().swap(m_fundamentals);
+    std::vector<std::vector<Mat3>>().swap(m_tfundamentals);
 }
 
-void Cseed::initialMatch(const int index, const int id)
+void Cseed::initialMatch(const int index, const int id, CoptimContext& context)
 {
-    std::vector<int> indexes;
-    m_fm.m_optim.collectImages(index, indexes);
-
-    if (m_fm.m_tau < (int)indexes.size()) indexes.resize(m_fm.m_tau);
-
-    if (indexes.empty()) return;
+    if (m_indexes[index].empty()) return;
 
     int totalcount = 0;
 
@@ -159,7 +212,7 @@ void Cseed::initialMatch(const int index, const int id)
             {
                 // Collect features that satisfy epipolar geometry constraints and sort them according to the differences of distances between two cameras.
                 std::vector<Ppoint> vcp;
-                collectCandidates(index, indexes, *m_ppoints[index][index2][p], vcp);
+                collectCandidates(index, *m_ppoints[index][index2][p], vcp);
 
                 int count = 0;
                 Cpatch bestpatch;
@@ -181,7 +234,7 @@ void Cseed::initialMatch(const int index, const int id)
                     if (vcp[i]->m_itmp < m_fm.m_tnum)
                     ++m_fm.m_pos.m_counts[vcp[i]->m_itmp][index3];
 
-                    const int flag = initialMatchSub(index, vcp[i]->m_itmp, id, patch);
+                    const int flag = initialMatchSub(index, vcp[i]->m_itmp, id, context, patch);
                     if (flag == 0)
                     {
                         ++count;
@@ -203,7 +256,7 @@ void Cseed::initialMatch(const int index, const int id)
     std::cerr << '(' << index << ',' << totalcount << ')' << std::flush;
 }
 
-void Cseed::collectCells(const int index0, const int index1, const Cpoint& p0, std::vector<Vec2i>& cells)
+void Cseed::collectCells(const int index0, const int index1, const Mat3& tF, const Cpoint& p0, std::vector<Vec2i>& cells)
 {
     Vec3 point(p0.m_icoord[0], p0.m_icoord[1], p0.m_icoord[2]);
 
@@ -215,12 +268,10 @@ void Cseed::collectCells(const int index0, const int index1, const Cpoint& p0, s
     }
 #endif
 
-    Mat3 F;
-    Image::setF(m_fm.m_pss.m_photos[index0], m_fm.m_pss.m_photos[index1], F, m_fm.m_level);
     const int gwidth = m_fm.m_pos.m_gwidths[index1];
     const int gheight = m_fm.m_pos.m_gheights[index1];
 
-    Vec3 line = transpose(F) * point;
+    Vec3 line = tF * point;
     if (line[0] == 0.0 && line[1] == 0.0)
     {
         std::cerr << "Point right on top of the epipole?" << index0 << ' ' << index1 << std::endl;
@@ -258,17 +309,16 @@ void Cseed::collectCells(const int index0, const int index1, const Cpoint& p0, s
 }
 
 // Make sorted array of feature points in images, that satisfy the epipolar geometry coming from point in image
-void Cseed::collectCandidates(const int index, const std::vector<int>& indexes, const Cpoint& point, std::vector<Ppoint>& vcp)
+void Cseed::collectCandidates(const int index, const Cpoint& point, std::vector<Ppoint>& vcp)
 {
     const Vec3 p0(point.m_icoord[0], point.m_icoord[1], 1.0);
-    for (int i = 0; i < (int)indexes.size(); ++i)
+    for (int i = 0; i < (int)m_indexes[index].size(); ++i)
     {
-        const int indexid = indexes[i];
+        const int indexid = m_indexes[index][i];
 
         std::vector<TVec2<int> > cells;
-        collectCells(index, indexid, point, cells);
-        Mat3 F;
-        Image::setF(m_fm.m_pss.m_photos[index], m_fm.m_pss.m_photos[indexid], F, m_fm.m_level);
+        collectCells(index, indexid, m_tfundamentals[index][i], point, cells);
+        const Mat3& F = m_fundamentals[index][i];
 
         for (int i = 0; i < (int)cells.size(); ++i)
         {
@@ -395,7 +445,7 @@ void Cseed::unproject(const int index0, const int index1, const Cpoint& p0, cons
 }
 
 // Starting with (index, indexs), set visible images by looking at correlation.
-int Cseed::initialMatchSub(const int index0, const int index1, const int id, Cpatch& patch)
+int Cseed::initialMatchSub(const int index0, const int index1, const int id, CoptimContext& context, Cpatch& patch)
 {
     patch.m_images.clear();
     patch.m_images.push_back(index0);
@@ -404,15 +454,15 @@ int Cseed::initialMatchSub(const int index0, const int index1, const int id, Cpa
     ++m_scounts[id];
 
     // We know that patch.m_coord is inside bimages and inside mask
-    if (m_fm.m_optim.preProcess(patch, id, 1))
+    if (m_fm.m_optim.preProcess(patch, context, 1))
     {
         ++m_fcounts0[id];
         return 1;
     }
 
-    m_fm.m_optim.refinePatchBFGS(patch, id);
+    m_fm.m_optim.refinePatchBFGS(patch, context);
 
-    if (m_fm.m_optim.postProcess(patch, id, 1))
+    if (m_fm.m_optim.postProcess(patch, context, 1))
     {
         ++m_fcounts1[id];
         return 1;
@@ -10,6 +10,7 @@ namespace PMVS3
 {
 
 class CfindMatch;
+class CoptimContext;
 
 typedef std::shared_ptr<Cpoint> Ppoint;
 
@@ -27,12 +28,12 @@ protected:
     void readPoints(const std::vector<std::vector<Cpoint>>& points);
     int canAdd(const int index, const int x, const int y);  
 
-    void initialMatch(const int index, const int id);
-    void collectCells(const int index0, const int index1, const Cpoint& p0, std::vector<Vec2i>& cells);
+    void initialMatch(const int index, const int id, CoptimContext& context);
+    void collectCells(const int index0, const int index1, const Mat3& tF, const Cpoint& p0, std::vector<Vec2i>& cells);
 
-    void collectCandidates(const int index, const std::vector<int>& indexes, const Cpoint& point, std::vector<Ppoint>& vcp);
+    void collectCandidates(const int index, const Cpoint& point, std::vector<Ppoint>& vcp);
 
-    int initialMatchSub(const int index0, const int index1, const int id, Patch::Cpatch& patch);
+    int initialMatchSub(const int index0, const int index1, const int id, CoptimContext& context, Patch::Cpatch& patch);
 
     void unproject(const int index0, const int index1, const Cpoint& p0, const Cpoint& p1, Vec4f& coord) const;
 
@@ -41,6 +42,12 @@ protected:
     std::vector<std::vector<std::vector<Ppoint>>> m_ppoints;    // points in a grid. For each index, grid
 
     void initialMatchThread(void);
+    void initFundamentalThread(void);
+
+    // For each target image, images from collectImages and the fundamental matrices to them
+    std::vector<std::vector<int>> m_indexes;
+    std::vector<std::vector<Mat3>> m_fundamentals;
+    std::vector<std::vector<Mat3>> m_tfundamentals;    // Transposes, giving epipolar lines in the other images
 
     std::vector<int> m_scounts;     // Number of trials
     std::vector<int> m_fcounts0;    // Number of failures in the prep
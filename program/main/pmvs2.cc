@@ -22,6 +22,12 @@ int main(int argc, char* argv[])
                   << "minImageNum 3    CPU       4"                         << std::endl
                   << "useVisData  0    sequence -1"                         << std::endl
                   << "quad        2.5  maxAngle 10.0"                       << std::endl
+                  << "cascade     0    cascadeWsize 5"                      << std::endl
+                  << "cascadeThreshold 0.3  depthSearch 0"                  << std::endl
+                  << "fixedPoint  0    minLevel  0"                         << std::endl
+                  << "pyramidCache 0   imageBudget 0"                       << std::endl
+                  << "grayFeatures 0   featureCache 0"                      << std::endl
+                  << "imageLayout 0"                                        << std::endl
                   << "--------------------------------------------------"   << std::endl
                   << "2 ways to specify targetting images"                  << std::endl
                   << "timages  5  1  3  5  7  9 (enumeration)"              << std::endl